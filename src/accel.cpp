@@ -1,71 +1,220 @@
 #include "accel.h"
 #include "hittable.h"
+#include <bit>
 #include <limits.h>
-size_t BVH::MAX_PRIMITIVES_PER_LEAF = 4;
-BVH::BVH(const std::vector<std::unique_ptr<Hittable>> &list) : list(list) {}
+size_t BVHTree::MAX_PRIMITIVES_PER_LEAF = 4;
+size_t BVHTree::MAX_SAH_PRIMITIVES_PER_LEAF = 16;
+int BVHTree::SAH_BUCKETS = 12;
+float BVHTree::TRAVERSAL_COST = 0.125f;
+float BVHTree::INTERSECTION_COST = 1.0f;
+BVHTree::BuildSettings BVHTree::build_settings() const {
+  return BuildSettings{static_cast<uint32_t>(MAX_PRIMITIVES_PER_LEAF),
+                       static_cast<uint32_t>(MAX_SAH_PRIMITIVES_PER_LEAF),
+                       SAH_BUCKETS,
+                       TRAVERSAL_COST,
+                       INTERSECTION_COST,
+                       static_cast<int32_t>(m_split_method),
+                       m_leaf_block_size};
+}
+
+BVH::BVH(const std::vector<std::unique_ptr<Hittable>> &list,
+         SplitMethod split_method)
+    : tree(split_method), list(list) {}
+
+std::vector<BVHPrimitiveInfo>
+primitive_info(const std::vector<std::unique_ptr<Hittable>> &list) {
+  std::vector<BVHPrimitiveInfo> primitives(list.size());
+  for (size_t i = 0; i < list.size(); i++) {
+    auto box = list[i]->bbox();
+    primitives[i] = BVHPrimitiveInfo{box, box.center(), static_cast<int>(i)};
+  }
+  return primitives;
+}
 
 void BVH::build(const std::vector<std::unique_ptr<Hittable>> &list) {
+  tree.build(primitive_info(list));
+}
+
+bool BVH::hit(const Ray &ray, HitRecord &record) const {
+  return tree.hit(ray, record,
+                  [this](int index, const Ray &r, HitRecord &rec) {
+                    return intersect_closest(*list[index], r, rec);
+                  });
+}
+
+bool BVH::occluded(const Ray &r, float t_max) const {
+  Ray ray = r;
+  ray.t_max = std::min(ray.t_max, t_max);
+  return tree.occluded(ray, [this](int index, const Ray &ray) {
+    return occluded_primitive(*list[index], ray, ray.t_max);
+  });
+}
+
+void BVHTree::build(std::vector<BVHPrimitiveInfo> primitives) {
   nodes.clear();
-  root = -1;
-  std::vector<int> indices(list.size());
-  std::iota(indices.begin(), indices.end(), 0);
-  root = build_recursive(indices);
+  primitive_indices.clear();
+  primitive_indices.reserve(primitives.size());
+  if (primitives.empty()) {
+    m_sah_cost = 0.0f;
+    return;
+  }
+  build_recursive(primitives, 0, primitives.size(), 0);
+  m_sah_cost = compute_sah_cost();
 }
 
-int BVH::build_recursive(std::vector<int> &indices) {
+int BVHTree::build_recursive(std::vector<BVHPrimitiveInfo> &primitives, int begin,
+                         int end, int depth) {
   BBox box;
-  for (auto i : indices) {
-    box.expand(list[i]->bbox());
-  }
-  if (indices.size() <= MAX_PRIMITIVES_PER_LEAF) {
-    int node_index = nodes.size();
-    nodes.push_back(BVHNode{-1, -1, box, indices});
-    return node_index;
+  BBox centroid_box;
+  for (int i = begin; i < end; i++) {
+    box.expand(primitives[i].bounds);
+    centroid_box.expand(primitives[i].centroid);
   }
-  int axis = box.max_extent();
-  std::sort(indices.begin(), indices.end(), [this, axis](int a, int b) {
-    return list[a]->bbox().center()[axis] < list[b]->bbox().center()[axis];
-  });
-  int mid = indices.size() / 2;
-  std::vector<int> left_indices(indices.begin(), indices.begin() + mid);
-  std::vector<int> right_indices(indices.begin() + mid, indices.end());
-  auto left = build_recursive(left_indices);
-  auto right = build_recursive(right_indices);
-  auto node = BVHNode{left, right, box, {}};
+  // Median splits halve the range, so a range of n primitives ends in
+  // leaves at most bit_width(n - 1) levels down. Near MAX_DEPTH they take
+  // over from the SAH, which can peel off one primitive per level.
+  bool sah = m_split_method == SplitMethod::SAH &&
+             depth + std::bit_width(static_cast<unsigned>(end - begin - 1)) <
+                 MAX_DEPTH;
+  int axis = sah ? centroid_box.max_extent() : box.max_extent();
+  int mid = sah ? partition_sah(primitives, begin, end, axis, box, centroid_box)
+                : partition_median(primitives, begin, end, axis);
 
   int node_index = nodes.size();
-  nodes.push_back(node);
+  nodes.emplace_back();
+  nodes[node_index].bbox = box;
+  nodes[node_index].axis = axis;
+  if (mid < 0) {
+    nodes[node_index].primitives_offset = primitive_indices.size();
+    nodes[node_index].primitive_count = end - begin;
+    for (int i = begin; i < end; i++) {
+      primitive_indices.push_back(primitives[i].index);
+    }
+    return node_index;
+  }
+  nodes[node_index].primitive_count = 0;
+  build_recursive(primitives, begin, mid, depth + 1);
+  nodes[node_index].second_child_offset =
+      build_recursive(primitives, mid, end, depth + 1);
   return node_index;
 }
 
-bool BVH::hit(const Ray &ray, HitRecord &record) const {
-  return hit_node(ray, record, root);
+int BVHTree::partition_median(std::vector<BVHPrimitiveInfo> &primitives,
+                          int begin, int end, int axis) const {
+  if (static_cast<size_t>(end - begin) <= MAX_PRIMITIVES_PER_LEAF) {
+    return -1;
+  }
+  int mid = begin + (end - begin) / 2;
+  std::nth_element(primitives.begin() + begin, primitives.begin() + mid,
+                   primitives.begin() + end,
+                   [axis](const BVHPrimitiveInfo &a,
+                          const BVHPrimitiveInfo &b) {
+                     return a.centroid[axis] < b.centroid[axis];
+                   });
+  return mid;
 }
 
-bool BVH::hit_node(const Ray &ray, HitRecord &record, int node) const {
-  if (!nodes[node].bbox.hit(ray)) {
-    return false;
+int BVHTree::partition_sah(std::vector<BVHPrimitiveInfo> &primitives, int begin,
+                       int end, int axis, const BBox &box,
+                       const BBox &centroid_box) const {
+  int count = end - begin;
+  if (count <= 1) {
+    return -1;
+  }
+  size_t max_leaf = m_leaf_block_size > 1
+                        ? static_cast<size_t>(m_leaf_block_size)
+                        : MAX_SAH_PRIMITIVES_PER_LEAF;
+  float cmin = centroid_box.min()[axis];
+  float extent = centroid_box.max()[axis] - cmin;
+  if (extent <= 0.0f) {
+    // all centroids coincide, no split can separate them
+    if (static_cast<size_t>(count) <= max_leaf) {
+      return -1;
+    }
+    return begin + count / 2;
+  }
+
+  struct Bucket {
+    int count = 0;
+    BBox bounds;
+  };
+  std::vector<Bucket> buckets(SAH_BUCKETS);
+  auto bucket_of = [&](const BVHPrimitiveInfo &p) {
+    int b = static_cast<int>(SAH_BUCKETS * (p.centroid[axis] - cmin) / extent);
+    return std::clamp(b, 0, SAH_BUCKETS - 1);
+  };
+  for (int i = begin; i < end; i++) {
+    auto &bucket = buckets[bucket_of(primitives[i])];
+    bucket.count++;
+    bucket.bounds.expand(primitives[i].bounds);
+  }
+
+  // costs[i] is the unnormalized cost of splitting after bucket i
+  std::vector<float> costs(SAH_BUCKETS - 1, 0.0f);
+  BBox below;
+  int count_below = 0;
+  for (int i = 0; i < SAH_BUCKETS - 1; i++) {
+    if (buckets[i].count > 0) {
+      below.expand(buckets[i].bounds);
+      count_below += buckets[i].count;
+    }
+    if (count_below > 0) {
+      costs[i] += leaf_cost(count_below) * below.surface_area();
+    }
   }
-  HitRecord temp;
-  bool hit = false;
-  float closest = std::min(record.t, ray.t_max);
-  if (nodes[node].left < 0 && nodes[node].right < 0) {
-    for (const auto &primitive : nodes[node].primitives) {
-      const auto &object = list[primitive];
-      if (object->hit(ray, temp) && temp.t < closest) {
-        closest = temp.t;
-        record = temp;
-        hit = true;
-      }
+  BBox above;
+  int count_above = 0;
+  for (int i = SAH_BUCKETS - 1; i > 0; i--) {
+    if (buckets[i].count > 0) {
+      above.expand(buckets[i].bounds);
+      count_above += buckets[i].count;
+    }
+    if (count_above > 0) {
+      costs[i - 1] += leaf_cost(count_above) * above.surface_area();
     }
   }
 
-  if (nodes[node].left >= 0) {
-    hit |= hit_node(ray, record, nodes[node].left);
+  int best = 0;
+  for (int i = 1; i < SAH_BUCKETS - 1; i++) {
+    if (costs[i] < costs[best]) {
+      best = i;
+    }
   }
-  if (nodes[node].right >= 0) {
-    hit |= hit_node(ray, record, nodes[node].right);
+
+  // compare both options scaled by the node's surface area
+  float area = box.surface_area();
+  float split_cost = TRAVERSAL_COST * area + costs[best];
+  if (static_cast<size_t>(count) <= max_leaf &&
+      leaf_cost(count) * area <= split_cost) {
+    return -1;
   }
 
-  return hit;
+  auto mid = std::partition(primitives.begin() + begin,
+                            primitives.begin() + end,
+                            [&](const BVHPrimitiveInfo &p) {
+                              return bucket_of(p) <= best;
+                            });
+  return mid - primitives.begin();
+}
+
+float BVHTree::leaf_cost(int count) const {
+  int blocks = (count + m_leaf_block_size - 1) / m_leaf_block_size;
+  return INTERSECTION_COST * blocks;
+}
+
+float BVHTree::compute_sah_cost() const {
+  float root_area = nodes[0].bbox.surface_area();
+  if (root_area <= 0.0f) {
+    return 0.0f;
+  }
+  float cost = 0.0f;
+  for (const auto &node : nodes) {
+    float p = node.bbox.surface_area() / root_area;
+    if (node.primitive_count > 0) {
+      cost += p * leaf_cost(node.primitive_count);
+    } else {
+      cost += p * TRAVERSAL_COST;
+    }
+  }
+  return cost;
 }
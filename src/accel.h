@@ -1,7 +1,9 @@
 #pragma once
 #include "bbox.h"
+#include "packet.h"
 #include "record.h"
 #include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <numeric>
 #include <vector>
@@ -9,38 +11,259 @@ class Hittable;
 class Accel {
 public:
   virtual void build(const std::vector<std::unique_ptr<Hittable>> &list) = 0;
+  // closest hit as found by Hittable::intersect, the caller fills in the
+  // hit attributes
   virtual bool hit(const Ray &ray, HitRecord &record) const = 0;
+  // whether anything is hit between ray.t_min and t_max, for shadow rays;
+  // stops at the first hit found and computes no hit attributes
+  virtual bool occluded(const Ray &ray, float t_max) const = 0;
   virtual BBox bbox() const = 0;
+
+  // closest hits for a packet of rays, the same as tracing them one by one
+  virtual void hit(const RayPacket &packet, HitRecord *records,
+                   bool *hits) const {
+    for (int i = 0; i < packet.count; i++) {
+      hits[i] = hit(packet.rays[i], records[i]);
+    }
+  }
+
+  // whether each ray of a packet is occluded before its own t_max, the same
+  // as testing them one by one
+  virtual void occluded(const RayPacket &packet, bool *blocked) const {
+    for (int i = 0; i < packet.count; i++) {
+      blocked[i] = occluded(packet.rays[i], packet.rays[i].t_max);
+    }
+  }
 };
 
-struct BVHNode {
-  int left;
-  int right;
+// nodes are stored in depth-first order, so the first child of an interior
+// node always directly follows it
+struct alignas(32) BVHNode {
   BBox bbox;
-  // this is only used for leaf nodes
-  std::vector<int> primitives;
+  union {
+    // leaf: first entry in BVHTree::primitive_indices
+    int primitives_offset;
+    // interior: index of the second child
+    int second_child_offset;
+  };
+  // zero for interior nodes
+  uint16_t primitive_count;
+  // split axis, used to visit the nearer child first
+  uint8_t axis;
+  uint8_t pad[1];
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fill half a cache line");
+
+// bounds and centroid of a primitive, computed once per build
+struct BVHPrimitiveInfo {
+  BBox bounds;
+  glm::vec3 centroid;
+  int index;
+};
+
+// bounds of every object in list, indexed like list
+std::vector<BVHPrimitiveInfo>
+primitive_info(const std::vector<std::unique_ptr<Hittable>> &list);
+
+enum class AccelType {
+  // binary BVH
+  BVH,
+  // 4 and 8 wide BVHs collapsed from the binary one, see wide_bvh.h
+  BVH4,
+  BVH8,
+};
+
+enum class SplitMethod {
+  // split at the object median along the largest axis
+  Median,
+  // binned surface area heuristic
+  SAH,
+};
+
+// Bounding volume hierarchy over an abstract set of primitives, given by
+// their bounds. Leaves refer to primitives by their index in the build input;
+// hit() hands those indices to a caller supplied intersection function.
+class BVHTree {
+public:
+  // With leaf_block_size > 1 the primitives of a leaf are tested
+  // leaf_block_size at a time, as one SIMD block, so the SAH prices leaves
+  // by the blocks they fill and keeps them to at most one block.
+  BVHTree(SplitMethod split_method = SplitMethod::SAH, int leaf_block_size = 1)
+      : m_split_method(split_method), m_leaf_block_size(leaf_block_size) {}
+
+  void build(std::vector<BVHPrimitiveInfo> primitives);
+
+  // intersect(index, ray, record) must only update record for hits closer
+  // than both record.t and ray.t_max and return whether it did
+  template <typename Intersect>
+  bool hit(const Ray &r, HitRecord &record, Intersect &&intersect) const;
+
+  // whether occluded(index, ray) is true for any primitive whose bounds the
+  // ray passes within [ray.t_min, ray.t_max], in no particular order
+  template <typename Occluded>
+  bool occluded(const Ray &ray, Occluded &&occluded) const;
+
+  bool empty() const { return primitive_indices.empty(); }
+
+  BBox bbox() const { return nodes.empty() ? BBox() : nodes[0].bbox; }
+
+  // expected cost of a random ray through the tree, relative to the cost of
+  // one primitive intersection
+  float sah_cost() const { return m_sah_cost; }
+
+  size_t node_count() const { return nodes.size(); }
+
+  // deepest a leaf is built, which bounds the traversal stacks
+  static constexpr int MAX_DEPTH = 64;
+
+  // everything that shapes a built tree, so caches of built trees can
+  // tell when they are stale
+  struct BuildSettings {
+    uint32_t max_primitives_per_leaf;
+    uint32_t max_sah_primitives_per_leaf;
+    int32_t sah_buckets;
+    float traversal_cost;
+    float intersection_cost;
+    int32_t split_method;
+    int32_t leaf_block_size;
+  };
+  BuildSettings build_settings() const;
+
+private:
+  template <int N> friend class WideBVHTree;
+
+  int build_recursive(std::vector<BVHPrimitiveInfo> &primitives, int begin,
+                      int end, int depth);
+
+  // both return the partition point, or -1 if the range should be a leaf
+  int partition_median(std::vector<BVHPrimitiveInfo> &primitives, int begin,
+                       int end, int axis) const;
+  int partition_sah(std::vector<BVHPrimitiveInfo> &primitives, int begin,
+                    int end, int axis, const BBox &box,
+                    const BBox &centroid_box) const;
+
+  float compute_sah_cost() const;
+  // intersection cost of a leaf of count primitives
+  float leaf_cost(int count) const;
+
+private:
+  std::vector<BVHNode> nodes;
+  // primitive indices referenced by the leaves, in leaf order
+  std::vector<int> primitive_indices;
+  SplitMethod m_split_method;
+  int m_leaf_block_size;
+  float m_sah_cost = 0.0f;
+
+  static size_t MAX_PRIMITIVES_PER_LEAF;
+  static size_t MAX_SAH_PRIMITIVES_PER_LEAF;
+  static int SAH_BUCKETS;
+  static float TRAVERSAL_COST;
+  static float INTERSECTION_COST;
 };
 
+template <typename Intersect>
+bool BVHTree::hit(const Ray &r, HitRecord &record,
+                  Intersect &&intersect) const {
+  if (primitive_indices.empty()) {
+    return false;
+  }
+  // t_max is tightened to the closest hit so far to cull farther nodes
+  Ray ray = r;
+  ray.t_max = std::min(record.t, ray.t_max);
+  glm::vec3 inv_dir = 1.0f / ray.direction();
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+  bool hit = false;
+  int stack[MAX_DEPTH];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const BVHNode &node = nodes[current];
+    if (node.bbox.hit(ray, inv_dir, dir_is_neg)) {
+      if (node.primitive_count > 0) {
+        for (int i = 0; i < node.primitive_count; i++) {
+          if (intersect(primitive_indices[node.primitives_offset + i], ray,
+                        record)) {
+            ray.t_max = record.t;
+            hit = true;
+          }
+        }
+        if (stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else if (dir_is_neg[node.axis]) {
+        // visit the nearer child first
+        stack[stack_size++] = current + 1;
+        current = node.second_child_offset;
+      } else {
+        stack[stack_size++] = node.second_child_offset;
+        current = current + 1;
+      }
+    } else {
+      if (stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  return hit;
+}
+
+template <typename Occluded>
+bool BVHTree::occluded(const Ray &ray, Occluded &&occluded) const {
+  if (primitive_indices.empty()) {
+    return false;
+  }
+  glm::vec3 inv_dir = 1.0f / ray.direction();
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+  int stack[MAX_DEPTH];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const BVHNode &node = nodes[current];
+    if (node.bbox.hit(ray, inv_dir, dir_is_neg)) {
+      if (node.primitive_count == 0) {
+        stack[stack_size++] = node.second_child_offset;
+        current = current + 1;
+        continue;
+      }
+      for (int i = 0; i < node.primitive_count; i++) {
+        if (occluded(primitive_indices[node.primitives_offset + i], ray)) {
+          return true;
+        }
+      }
+    }
+    if (stack_size == 0) {
+      return false;
+    }
+    current = stack[--stack_size];
+  }
+}
+
+// top level hierarchy over the objects of a scene
 class BVH : public Accel {
 public:
-  BVH(const std::vector<std::unique_ptr<Hittable>> &list);
+  BVH(const std::vector<std::unique_ptr<Hittable>> &list,
+      SplitMethod split_method = SplitMethod::SAH);
 
   virtual void
   build(const std::vector<std::unique_ptr<Hittable>> &list) override;
 
-  virtual BBox bbox() const override { return nodes[root].bbox; }
+  virtual BBox bbox() const override { return tree.bbox(); }
 
+  using Accel::hit;
   virtual bool hit(const Ray &ray, HitRecord &record) const override;
 
-private:
-  int build_recursive(std::vector<int> &indices);
+  using Accel::occluded;
+  virtual bool occluded(const Ray &ray, float t_max) const override;
+
+  float sah_cost() const { return tree.sah_cost(); }
 
-  bool hit_node(const Ray &ray, HitRecord &record, int node) const;
+  size_t node_count() const { return tree.node_count(); }
 
 private:
-  std::vector<BVHNode> nodes;
-  size_t root;
+  BVHTree tree;
   const std::vector<std::unique_ptr<Hittable>> &list;
-
-  static size_t MAX_PRIMITIVES_PER_LEAF;
 };
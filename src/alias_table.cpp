@@ -0,0 +1,49 @@
+#include "alias_table.h"
+#include <algorithm>
+
+AliasTable::AliasTable(std::span<const float> weights)
+    : m_bins(weights.size()) {
+  if (weights.empty()) {
+    return;
+  }
+  double total = 0.0;
+  for (float weight : weights) {
+    total += std::max(weight, 0.0f);
+  }
+  int n = static_cast<int>(weights.size());
+  // weights scaled so that their mean is 1, split into bins below and above
+  std::vector<double> scaled(n);
+  std::vector<int> small, large;
+  for (int i = 0; i < n; i++) {
+    double p = total > 0.0 ? std::max(weights[i], 0.0f) / total : 1.0 / n;
+    m_bins[i] = Bin{1.0f, static_cast<float>(p), i};
+    scaled[i] = p * n;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+  // every small bin is topped up from a large one, which may become small
+  while (!small.empty() && !large.empty()) {
+    int s = small.back();
+    small.pop_back();
+    int l = large.back();
+    m_bins[s].threshold = static_cast<float>(scaled[s]);
+    m_bins[s].alias = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // what is left is 1 up to rounding and keeps its threshold of 1
+}
+
+int AliasTable::sample(float u, float &pmf) const {
+  int n = size();
+  float scaled = u * n;
+  int index = std::min(static_cast<int>(scaled), n - 1);
+  float remainder = scaled - index;
+  if (remainder >= m_bins[index].threshold) {
+    index = m_bins[index].alias;
+  }
+  pmf = m_bins[index].pmf;
+  return index;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Walker's alias method: picks index i with probability weight[i] / sum of
+// weights in constant time from one uniform number, whatever the number of
+// entries. If no weight is positive every index is equally likely.
+class AliasTable {
+public:
+  AliasTable() = default;
+  explicit AliasTable(std::span<const float> weights);
+
+  // index for u in [0, 1), setting pmf to its probability
+  int sample(float u, float &pmf) const;
+  float pmf(int index) const { return m_bins[index].pmf; }
+
+  int size() const { return static_cast<int>(m_bins.size()); }
+  bool empty() const { return m_bins.empty(); }
+
+private:
+  struct Bin {
+    // chance of keeping the bin's own index rather than its alias
+    float threshold;
+    float pmf;
+    int32_t alias;
+  };
+  std::vector<Bin> m_bins;
+};
@@ -5,9 +5,9 @@
 class BBox {
 public:
   BBox() {
-    max_ = glm::vec3(std::numeric_limits<float>::min(),
-                     std::numeric_limits<float>::min(),
-                     std::numeric_limits<float>::min());
+    max_ = glm::vec3(std::numeric_limits<float>::lowest(),
+                     std::numeric_limits<float>::lowest(),
+                     std::numeric_limits<float>::lowest());
     min_ = glm::vec3(std::numeric_limits<float>::max(),
                      std::numeric_limits<float>::max(),
                      std::numeric_limits<float>::max());
@@ -86,6 +86,23 @@ public:
     return true;
   }
 
+  // slab test with the ray's inverse direction and its per-axis sign
+  // precomputed by the caller
+  bool hit(const Ray &ray, const glm::vec3 &inv_dir,
+           const int dir_is_neg[3]) const {
+    float t0 = ray.t_min;
+    float t1 = ray.t_max;
+    for (int i = 0; i < 3; i++) {
+      float t_near =
+          ((dir_is_neg[i] ? max_[i] : min_[i]) - ray.o[i]) * inv_dir[i];
+      float t_far =
+          ((dir_is_neg[i] ? min_[i] : max_[i]) - ray.o[i]) * inv_dir[i];
+      t0 = t_near > t0 ? t_near : t0;
+      t1 = t_far < t1 ? t_far : t1;
+    }
+    return t0 <= t1;
+  }
+
 private:
   glm::vec3 min_;
   glm::vec3 max_;
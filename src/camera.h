@@ -9,6 +9,14 @@ public:
       : m_transform(Transform::lookAt(eye, center, up)), m_fov(fov),
         m_aspect(aspect) {}
 
+  // the camera moved by a world space transform, e.g. one frame of a
+  // turntable
+  Camera transformed(const Transform &transform) const {
+    Camera camera = *this;
+    camera.m_transform = transform * m_transform;
+    return camera;
+  }
+
   Ray get_ray(float s, float t) const {
     auto theta = glm::radians(m_fov);
     auto half_height = glm::tan(theta / 2);
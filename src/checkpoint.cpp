@@ -0,0 +1,137 @@
+#include "checkpoint.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+static_assert(std::is_trivially_copyable_v<PixelStats>,
+              "pixel stats are stored in the checkpoint as raw bytes");
+
+namespace {
+const char MAGIC[8] = {'A', 'R', 'R', 'O', 'W', 'C', 'K', 'P'};
+}
+
+Checkpoint::~Checkpoint() { close(); }
+
+bool Checkpoint::open(const std::string &path, const CheckpointKey &key,
+                      int tile_count) {
+  close();
+  m_path = path;
+  m_pixel_count = static_cast<size_t>(key.width) * key.height;
+  m_size = sizeof(Header) + m_pixel_count * sizeof(PixelStats) + tile_count;
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    std::cerr << "Cannot open checkpoint " << path << std::endl;
+    return false;
+  }
+  struct stat st;
+  bool match = false;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == m_size) {
+    Header header;
+    match = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+            header.version == VERSION &&
+            std::memcmp(&header.key, &key, sizeof(key)) == 0;
+  }
+  if (!match) {
+    // truncating to zero first zeroes the whole file
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, m_size) != 0) {
+      std::cerr << "Cannot resize checkpoint " << path << std::endl;
+      ::close(fd);
+      return false;
+    }
+  }
+  m_data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (m_data == MAP_FAILED) {
+    std::cerr << "Cannot map checkpoint " << path << std::endl;
+    m_data = nullptr;
+    return false;
+  }
+  if (!match) {
+    // the rest of the zeroed file holds empty stats and no finished tiles
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.key = key;
+    std::memcpy(m_data, &header, sizeof(header));
+  }
+  m_tile_done.assign(file_tile_done(), file_tile_done() + tile_count);
+  m_resumed = match;
+  return true;
+}
+
+void Checkpoint::close() {
+  if (m_data) {
+    sync();
+    munmap(m_data, m_size);
+    m_data = nullptr;
+  }
+  m_resumed = false;
+}
+
+void Checkpoint::remove() {
+  if (!m_data) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_flush_mutex);
+    if (m_flush.valid()) {
+      m_flush.wait();
+    }
+  }
+  munmap(m_data, m_size);
+  m_data = nullptr;
+  m_resumed = false;
+  m_tile_done.clear();
+  ::unlink(m_path.c_str());
+}
+
+PixelStats *Checkpoint::stats() const {
+  return reinterpret_cast<PixelStats *>(static_cast<char *>(m_data) +
+                                        sizeof(Header));
+}
+
+uint8_t *Checkpoint::file_tile_done() const {
+  return reinterpret_cast<uint8_t *>(stats() + m_pixel_count);
+}
+
+void Checkpoint::flush() {
+  // called by workers; one that finds a flush running skips its own
+  std::unique_lock<std::mutex> lock(m_flush_mutex, std::try_to_lock);
+  if (!lock.owns_lock() ||
+      (m_flush.valid() &&
+       m_flush.wait_for(std::chrono::seconds(0)) != std::future_status::ready)) {
+    return;
+  }
+  m_flush = std::async(std::launch::async, [this] { write_back(); });
+}
+
+void Checkpoint::sync() {
+  std::lock_guard<std::mutex> lock(m_flush_mutex);
+  if (m_flush.valid()) {
+    m_flush.wait();
+  }
+  write_back();
+}
+
+void Checkpoint::write_back() {
+  // The flags are read first: the stats of every tile marked done by then
+  // were written before its flag and are on disk after the first sync, so
+  // the file never holds a done flag for stats it lost. MS_ASYNC would not
+  // do, on Linux it does not start any writeback.
+  std::vector<uint8_t> done(m_tile_done.size());
+  for (size_t i = 0; i < done.size(); i++) {
+    done[i] = std::atomic_ref<uint8_t>(m_tile_done[i])
+                  .load(std::memory_order_acquire);
+  }
+  msync(m_data, m_size, MS_SYNC);
+  std::memcpy(file_tile_done(), done.data(), done.size());
+  msync(m_data, m_size, MS_SYNC);
+}
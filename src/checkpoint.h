@@ -0,0 +1,86 @@
+#pragma once
+#include "film.h"
+#include "fingerprint.h"
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Render settings a checkpoint must match to be resumed.
+struct CheckpointKey {
+  int32_t width;
+  int32_t height;
+  int32_t tile_size;
+  int32_t depth;
+  // fixed, adaptive or progressive
+  int32_t mode;
+  // spp, max_spp or pass_spp for the mode
+  int32_t spp;
+  // hash of everything else that shapes the image: the other render
+  // settings, the integrator, the sampler, the scene and the camera
+  uint64_t fingerprint;
+};
+
+// Accumulation state of a render kept in a memory mapped file: the stats of
+// every pixel and a done flag per tile. Samplers are counter based, so the
+// sample counts in the stats are all the sampler state there is. Stats go
+// straight to the mapping, so a process that dies loses nothing. To survive
+// a machine crash as well, done flags are kept in memory and only written to
+// the file once the stats they cover are on disk.
+class Checkpoint {
+public:
+  Checkpoint() = default;
+  ~Checkpoint();
+  Checkpoint(const Checkpoint &) = delete;
+  Checkpoint &operator=(const Checkpoint &) = delete;
+
+  // Maps the file at path, keeping its contents if it holds a checkpoint for
+  // the same key and starting a zeroed one otherwise. Returns false if the
+  // file cannot be mapped.
+  bool open(const std::string &path, const CheckpointKey &key,
+            int tile_count);
+  void close();
+  // closes the checkpoint and deletes its file, for a finished render
+  void remove();
+
+  bool is_open() const { return m_data != nullptr; }
+  // whether open found earlier progress to resume from
+  bool resumed() const { return m_resumed; }
+  PixelStats *stats() const;
+  // Done flags of the tiles as of this run. A flag must be set with a
+  // release store after the tile's stats are written; it reaches the file
+  // with the next flush or sync.
+  uint8_t *tile_done() { return m_tile_done.data(); }
+
+  // writes the stats and then the done flags to disk on a background thread,
+  // unless the previous flush is still running
+  void flush();
+  // the same, waiting for it to finish
+  void sync();
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    CheckpointKey key;
+  };
+
+  static constexpr uint32_t VERSION = 2;
+
+  // one flush, run by only one thread at a time
+  void write_back();
+  uint8_t *file_tile_done() const;
+
+  std::string m_path;
+  void *m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_pixel_count = 0;
+  bool m_resumed = false;
+  std::vector<uint8_t> m_tile_done;
+
+  std::mutex m_flush_mutex;
+  std::future<void> m_flush;
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+
+// pixel rectangle [x0, x1) x [y0, y1) of the image
+struct Tile {
+  int x0, y0, x1, y1;
+  int width() const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+  int size() const { return width() * height(); }
+};
+
+// Work on one tile: samples [sample_begin, sample_end) of the pixels listed,
+// by index within the tile.
+struct TileSamples {
+  Tile tile;
+  std::vector<int> pixels;
+  int sample_begin;
+  int sample_end;
+};
+
+// Samples taken for one pixel: their sum, and Welford's running mean and
+// sum of squared deviations of their luminance for error estimates.
+struct PixelStats {
+  glm::vec3 sum = glm::vec3(0.0f);
+  float mean = 0.0f;
+  float m2 = 0.0f;
+  int count = 0;
+
+  void add(const glm::vec3 &radiance) {
+    sum += radiance;
+    count++;
+    float y = luminance(radiance);
+    float delta = y - mean;
+    mean += delta / count;
+    m2 += delta * (y - mean);
+  }
+
+  glm::vec3 color() const {
+    return count > 0 ? sum / float(count) : glm::vec3(0.0f);
+  }
+
+  // estimated standard deviation of the mean luminance
+  float error() const {
+    if (count < 2) {
+      return std::numeric_limits<float>::infinity();
+    }
+    return glm::sqrt(m2 / (count - 1) / count);
+  }
+
+  static float luminance(const glm::vec3 &c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+  }
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+// FNV-1a hash of the bytes of the values added, for
+// CheckpointKey::fingerprint. Values must not contain padding.
+class Fingerprint {
+public:
+  template <typename T> void add(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "values are hashed as raw bytes");
+    add_bytes(&value, sizeof(T));
+  }
+  template <typename T> void add(std::span<const T> values) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "values are hashed as raw bytes");
+    add(values.size());
+    add_bytes(values.data(), values.size_bytes());
+  }
+  void add(std::string_view text) { add_bytes(text.data(), text.size()); }
+
+  uint64_t value() const { return m_hash; }
+
+private:
+  void add_bytes(const void *data, size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++) {
+      m_hash = (m_hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+  }
+
+  uint64_t m_hash = 0xcbf29ce484222325ull;
+};
@@ -1,9 +1,11 @@
 #include "hittable.h"
 #include "accel.h"
 #include "bbox.h"
+#include "obj_loader.h"
 #include "record.h"
 #include "sampler.h"
 #include "sampling.h"
+#include "scene_cache.h"
 #include <cmath>
 #include <fstream>
 #include <glm/ext/scalar_common.hpp>
@@ -14,11 +16,7 @@
 #include <istream>
 #include <memory>
 #include <stdexcept>
-// include assimp headers
-// #include <assimp/Importer.hpp>
-// #include <assimp/postprocess.h>
-// #include <assimp/scene.h>
-bool Sphere::hit(const Ray &r, HitRecord &rec) const
+bool Sphere::intersect(const Ray &r, float t_max, float &t) const
 {
   glm::vec3 oc = r.origin() - center;
   float a = glm::dot(r.direction(), r.direction());
@@ -30,158 +28,186 @@ bool Sphere::hit(const Ray &r, HitRecord &rec) const
     return false;
   }
   float sqrt_discriminant = sqrt(discriminant);
-  float root = (-b - sqrt_discriminant) / a;
-  if (root <= r.t_min || root >= r.t_max)
+  t = (-b - sqrt_discriminant) / a;
+  if (t <= r.t_min || t >= t_max)
   {
-    root = (-b + sqrt_discriminant) / a;
-    if (root <= r.t_min || root >= r.t_max)
+    t = (-b + sqrt_discriminant) / a;
+    if (t <= r.t_min || t >= t_max)
     {
       return false;
     }
   }
-  if (root < rec.t)
+  return true;
+}
+
+bool Sphere::intersect(const Ray &r, HitRecord &rec) const
+{
+  float root;
+  if (!intersect(r, std::min(r.t_max, rec.t), root))
   {
-    rec.t = root;
-    rec.p = r.at(rec.t);
-    rec.normal = (rec.p - center) / radius;
-    if (glm::dot(r.direction(), rec.normal) > 0)
-    {
-      rec.normal = -rec.normal;
-    }
-    rec.object_id = id();
-    return true;
+    return false;
   }
-  return false;
+  rec.t = root;
+  rec.object_id = m_id;
+  rec.primitive_id = -1;
+  return true;
+}
+
+void Sphere::fill_hit(const Ray &r, HitRecord &rec) const
+{
+  rec.p = r.at(rec.t);
+  rec.normal = (rec.p - center) / radius;
+  if (glm::dot(r.direction(), rec.normal) > 0)
+  {
+    rec.normal = -rec.normal;
+  }
+  rec.material_id = m_material_id;
 }
 
 glm::vec3 Sphere::sample(const HitRecord &rec, Sampler *sampler) const
 {
   glm::vec3 direction = center - rec.p;
   auto distance_squared = glm::dot(direction, direction);
-  // create a new coordinate system based on the normal
-  auto w = direction;
-  auto a =
-      w.x > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+  // create a new coordinate system around the direction to the center
+  auto w = glm::normalize(direction);
+  auto a = glm::abs(w.x) > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f)
+                                : glm::vec3(1.0f, 0.0f, 0.0f);
   auto v = glm::normalize(glm::cross(w, a));
   auto u = glm::cross(w, v);
   // calculate the max cosine of the cone.
   auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
-  auto dir = sample_cone(sampler->get_1d(), sampler->get_1d(), cos_theta_max);
+  auto r = sampler->get_2d();
+  auto dir = sample_cone(r.x, r.y, cos_theta_max);
   return glm::normalize(dir.x * u + dir.y * v + dir.z * w);
 }
 
+bool Sphere::occluded(const Ray &r, float t_max) const
+{
+  float t;
+  return intersect(r, std::min(r.t_max, t_max), t);
+}
+
 float Sphere::pdf(const HitRecord &rec, const glm::vec3 &wi) const
 {
-  HitRecord test_rec;
-  if (!hit(Ray(rec.p, wi), test_rec))
+  // only whether wi reaches the sphere matters, not where
+  if (!occluded(Ray(rec.p, wi), std::numeric_limits<float>::max()))
   {
     return 0.0f;
   }
-  auto len = glm::length(center - rec.p);
-  auto cos_theta_max = sqrt(1 - radius * radius / len * len);
+  glm::vec3 direction = center - rec.p;
+  auto distance_squared = glm::dot(direction, direction);
+  auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
   float solid_angle = 2 * glm::pi<float>() * (1 - cos_theta_max);
   return 1 / solid_angle;
 }
 
-bool Scene::hit(const Ray &ray, HitRecord &rec) const
+bool Scene::intersect(const Ray &ray, HitRecord &rec) const
 {
   if (accel)
   {
     return accel->hit(ray, rec);
   }
-  HitRecord temp_rec;
+  // every object only records hits closer than the ones before
   bool hit_anything = false;
-  float closest_so_far = glm::min(rec.t, ray.t_max);
   for (const auto &object : list)
   {
-    if (object->hit(ray, temp_rec) && temp_rec.t < closest_so_far)
+    if (intersect_closest(*object, ray, rec))
     {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
     }
   }
   return hit_anything;
 }
 
+void Scene::fill_hit(const Ray &ray, HitRecord &rec) const
+{
+  visit_primitive(*list[rec.object_id], [&](const auto &primitive) {
+    primitive.fill_hit(ray, rec);
+  });
+}
+
+bool Scene::occluded(const Ray &ray, float t_max) const
+{
+  if (accel)
+  {
+    return accel->occluded(ray, t_max);
+  }
+  for (const auto &object : list)
+  {
+    if (occluded_primitive(*object, ray, t_max))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Scene::occluded(const RayPacket &packet, bool *blocked) const
+{
+  if (!accel)
+  {
+    for (int i = 0; i < packet.count; i++)
+    {
+      blocked[i] = occluded(packet.rays[i], packet.rays[i].t_max);
+    }
+    return;
+  }
+  accel->occluded(packet, blocked);
+}
+
+void Scene::hit(const RayPacket &packet, HitRecord *records, bool *hits) const
+{
+  if (!accel)
+  {
+    for (int i = 0; i < packet.count; i++)
+    {
+      hits[i] = hit(packet.rays[i], records[i]);
+    }
+    return;
+  }
+  accel->hit(packet, records, hits);
+  for (int i = 0; i < packet.count; i++)
+  {
+    if (hits[i])
+    {
+      fill_hit(packet.rays[i], records[i]);
+    }
+  }
+}
+
 std::unique_ptr<Scene> Scene::from_file(const std::string &filename)
 {
-  // Assimp::Importer importer;
-  // const aiScene *scene = importer.ReadFile(
-  //     filename, aiProcess_Triangulate | aiProcess_GenNormals |
-  //                   aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
-  // if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE ||
-  //     !scene->mRootNode)
-  // {
-  //   std::cerr << "ERROR::ASSIMP::" << importer.GetErrorString() << std::endl;
-  //   return nullptr;
-  // }
-  // auto output = std::make_unique<Scene>();
-  // output->list.reserve(scene->mNumMeshes);
-  // for (unsigned int i = 0; i < scene->mNumMeshes; i++)
-  // {
-  //   auto mesh = scene->mMeshes[i];
-  //   std::vector<glm::vec3> vertices;
-  //   std::vector<glm::vec3> normals;
-  //   std::vector<glm::vec2> uvs;
-  //   std::vector<glm::vec3> tangents;
-  //   std::vector<glm::vec3> bitangents;
-  //   vertices.reserve(mesh->mNumVertices);
-  //   normals.reserve(mesh->mNumVertices);
-  //   uvs.reserve(mesh->mNumVertices);
-  //   tangents.reserve(mesh->mNumVertices);
-  //   bitangents.reserve(mesh->mNumVertices);
-  //   for (unsigned int j = 0; j < mesh->mNumVertices; j++)
-  //   {
-  //     vertices.push_back(glm::vec3(mesh->mVertices[j].x, mesh->mVertices[j].y,
-  //                                  mesh->mVertices[j].z));
-  //     normals.push_back(glm::vec3(mesh->mNormals[j].x, mesh->mNormals[j].y,
-  //                                 mesh->mNormals[j].z));
-  //     if (mesh->mTextureCoords[0])
-  //     {
-  //       uvs.push_back(glm::vec2(mesh->mTextureCoords[0][j].x,
-  //                               mesh->mTextureCoords[0][j].y));
-  //     }
-  //     else
-  //     {
-  //       uvs.push_back(glm::vec2(0.0f, 0.0f));
-  //     }
-  //     if (mesh->mTangents)
-  //     {
-  //       tangents.push_back(glm::vec3(mesh->mTangents[j].x, mesh->mTangents[j].y,
-  //                                    mesh->mTangents[j].z));
-  //     }
-  //     else
-  //     {
-  //       tangents.push_back(glm::vec3(0.0f, 0.0f, 0.0f));
-  //     }
-  //     if (mesh->mBitangents)
-  //     {
-  //       bitangents.push_back(glm::vec3(mesh->mBitangents[j].x,
-  //                                      mesh->mBitangents[j].y,
-  //                                      mesh->mBitangents[j].z));
-  //     }
-  //     else
-  //     {
-  //       bitangents.push_back(glm::vec3(0.0f, 0.0f, 0.0f));
-  //     }
-  //   }
-  //   std::vector<unsigned int> indices;
-  //   indices.reserve(mesh->mNumFaces * 3);
-  //   for (unsigned int j = 0; j < mesh->mNumFaces; j++)
-  //   {
-  //     auto face = mesh->mFaces[j];
-  //     for (unsigned int k = 0; k < face.mNumIndices; k++)
-  //     {
-  //       indices.push_back(face.mIndices[k]);
-  //     }
-  //   }
-  //   auto mateiral = std::make_shared<Lambertian>(glm::vec3(0.73f, 0.73f, 0.73f));
-  //   auto object = std::make_unique<Mesh>(vertices, indices,
-  //                                        mateiral);
-  //   output->add(std::move(object));
-  // }
-  // return output;
+  // the meshes and their hierarchies are cached next to the file
+  std::string cache_path = filename + ".cache";
+  if (auto scene = load_scene_cache(cache_path))
+  {
+    std::cout << "Loaded " << filename << " from " << cache_path << std::endl;
+    return scene;
+  }
+  std::vector<std::string> sources = {filename};
+  auto scene = load_obj(filename, 0, &sources);
+  if (scene && !save_scene_cache(cache_path, *scene, sources))
+  {
+    std::cerr << "Cannot write scene cache " << cache_path << std::endl;
+  }
+  return scene;
+}
+
+void Scene::fingerprint(Fingerprint &hash) const
+{
+  hash.add(list.size());
+  for (const auto &object : list)
+  {
+    hash.add(object->primitive_type());
+    object->fingerprint(hash);
+    hash.add(object->material_id());
+  }
+  hash.add(materials.size());
+  for (size_t id = 0; id < materials.size(); id++)
+  {
+    hash.add(m_material_types[id]);
+    materials[id]->fingerprint(hash);
+  }
 }
 
 BBox Scene::bbox() const
@@ -213,6 +239,31 @@ BBox Scene::bbox() const
   return output_box;
 }
 
+void Scene::add(std::unique_ptr<Hittable> h)
+{
+  h->set_id(static_cast<int>(list.size()));
+  h->set_material_id(add_material(h->material()));
+  list.push_back(std::move(h));
+}
+
+int Scene::add_material(const std::shared_ptr<Material> &material)
+{
+  if (!material)
+  {
+    return -1;
+  }
+  auto it = m_material_ids.find(material.get());
+  if (it != m_material_ids.end())
+  {
+    return it->second;
+  }
+  int id = static_cast<int>(materials.size());
+  materials.push_back(material);
+  m_material_types.push_back(material->type());
+  m_material_ids.emplace(material.get(), id);
+  return id;
+}
+
 void Scene::build()
 {
   if (!accel)
@@ -221,96 +272,257 @@ void Scene::build()
   }
 
   // find all ids of lights
+  lights.clear();
   for (const auto &h : list)
   {
-    if (glm::length(h->material()->emitted()) > 0.0f)
+    if (h->material_id() >= 0 &&
+        glm::length(material(h->material_id())->emitted()) > 0.0f)
     {
-      lights.push_back(h->id().value());
+      lights.push_back(h->id());
     }
   }
-}
 
-void Scene::build_accel()
-{
-  accel = std::make_unique<BVH>(list);
-  accel->build(list);
+  build_lights();
 }
 
-bool Mesh::hit(const Ray &ray, HitRecord &rec) const
+void Scene::build_lights()
 {
-  bool is_hit = false;
-  float closest_so_far = glm::min(rec.t, ray.t_max);
-  for (size_t i = 0; i < m_indices.size(); i += 3)
+  m_emitters.clear();
+  m_emitter_offsets.assign(list.size(), -1);
+  std::vector<LightBounds> bounds;
+  for (int id : lights)
   {
-    const auto &v0 = m_vertices[m_indices[i]];
-    const auto &v1 = m_vertices[m_indices[i + 1]];
-    const auto &v2 = m_vertices[m_indices[i + 2]];
-
-    auto e1 = v1 - v0;
-    auto e2 = v2 - v0;
-    auto h = glm::cross(ray.direction(), e2);
-    auto a = glm::dot(e1, h);
-    if (a > -0.00001 && a < 0.00001)
+    const auto &object = list[id];
+    glm::vec3 emitted = material(object->material_id())->emitted();
+    float luminance = glm::dot(emitted, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    m_emitter_offsets[id] = static_cast<int>(m_emitters.size());
+    if (object->primitive_type() == PrimitiveType::Mesh)
     {
-      continue;
+      // one emitter per triangle, emitting on both sides around its normal
+      const auto &mesh = static_cast<const Mesh &>(*object);
+      auto vertices = mesh.vertices();
+      auto indices = mesh.indices();
+      for (size_t i = 0; i < indices.size(); i += 3)
+      {
+        const auto &v0 = vertices[indices[i]];
+        const auto &v1 = vertices[indices[i + 1]];
+        const auto &v2 = vertices[indices[i + 2]];
+        glm::vec3 normal = glm::cross(v1 - v0, v2 - v0);
+        float area = glm::length(normal) / 2.0f;
+        LightBounds light;
+        light.bounds = BBox(v0, v0);
+        light.bounds.expand(v1);
+        light.bounds.expand(v2);
+        light.phi = luminance * 2.0f * area;
+        if (area > 0.0f)
+        {
+          light.w = glm::normalize(normal);
+        }
+        light.cos_theta_o = 1.0f;
+        light.cos_theta_e = 0.0f;
+        light.two_sided = true;
+        bounds.push_back(light);
+        m_emitters.push_back(Emitter{id, static_cast<int>(i / 3)});
+      }
     }
-    auto f = 1.0 / a;
-    auto s = ray.origin() - v0;
-    auto u = f * glm::dot(s, h);
-    if (u < 0.0 || u > 1.0)
-    {
-      continue;
-    }
-    auto q = glm::cross(s, e1);
-    auto v = f * glm::dot(ray.direction(), q);
-    if (v < 0.0 || u + v > 1.0)
+    else
     {
-      continue;
+      // other objects may emit in every direction
+      LightBounds light;
+      light.bounds = object->bbox();
+      light.phi = luminance * object->surface_area();
+      light.cos_theta_o = -1.0f;
+      light.cos_theta_e = 0.0f;
+      bounds.push_back(light);
+      m_emitters.push_back(Emitter{id, -1});
     }
-    auto t = f * glm::dot(e2, q);
-    if (t > ray.t_min && t < closest_so_far)
-    {
-      closest_so_far = t;
-      rec.t = t;
-      rec.p = ray.at(t);
-      auto normal = glm::normalize(glm::cross(e1, e2));
+  }
+  m_light_bvh = LightBVH(bounds);
+}
 
-      rec.normal = glm::dot(normal, ray.direction()) > 0 ? -normal : normal;
+int Scene::sample_light(const glm::vec3 &p, const glm::vec3 &n, float u,
+                        float &pmf) const
+{
+  return m_light_bvh.sample(p, n, u, pmf);
+}
 
-      rec.object_id = id();
-      is_hit = true;
-    }
+int Scene::emitter_at(const HitRecord &rec) const
+{
+  if (rec.object_id < 0 ||
+      rec.object_id >= static_cast<int>(m_emitter_offsets.size()))
+  {
+    return -1;
   }
-  return is_hit;
+  int offset = m_emitter_offsets[rec.object_id];
+  if (offset < 0 || m_emitters[offset].triangle < 0)
+  {
+    return offset;
+  }
+  return rec.primitive_id < 0 ? -1 : offset + rec.primitive_id;
 }
 
-BBox Mesh::bbox() const
+glm::vec3 Scene::sample_emitter(int emitter, const HitRecord &rec,
+                                Sampler *sampler) const
 {
-  BBox output_box;
-  bool first_box = true;
-  for (const auto &v : m_vertices)
+  const Emitter &e = m_emitters[emitter];
+  if (e.triangle < 0)
   {
-    if (first_box)
+    return list[e.id]->sample(rec, sampler);
+  }
+  return static_cast<const Mesh &>(*list[e.id])
+      .sample_triangle(e.triangle, rec, sampler);
+}
+
+float Scene::emitter_pdf(int emitter, const HitRecord &rec,
+                         const glm::vec3 &dir) const
+{
+  const Emitter &e = m_emitters[emitter];
+  if (e.triangle < 0)
+  {
+    return list[e.id]->pdf(rec, dir);
+  }
+  return static_cast<const Mesh &>(*list[e.id])
+      .triangle_pdf(e.triangle, rec, dir);
+}
+
+void Scene::build_accel()
+{
+  switch (accel_type)
+  {
+  case AccelType::BVH:
+    accel = std::make_unique<BVH>(list, split_method);
+    break;
+  case AccelType::BVH4:
+    accel = std::make_unique<BVH4>(list, split_method);
+    break;
+  case AccelType::BVH8:
+    accel = std::make_unique<BVH8>(list, split_method);
+    break;
+  }
+  accel->build(list);
+}
+
+void Mesh::build_bvh()
+{
+  std::vector<BVHPrimitiveInfo> triangles(m_indices.size() / 3);
+  for (size_t i = 0; i < triangles.size(); i++)
+  {
+    const auto &v0 = m_vertices[m_indices[i * 3]];
+    BBox box(v0, v0);
+    box.expand(m_vertices[m_indices[i * 3 + 1]]);
+    box.expand(m_vertices[m_indices[i * 3 + 2]]);
+    triangles[i] = BVHPrimitiveInfo{box, box.center(), static_cast<int>(i)};
+  }
+  BVHTree binary(SplitMethod::SAH, TRIANGLE_BLOCK_SIZE);
+  binary.build(std::move(triangles));
+  m_bvh.build(binary, TRIANGLE_BLOCK_SIZE);
+  m_block_storage =
+      build_triangle_blocks(m_vertices, m_indices, m_bvh.index_data());
+  m_blocks = m_block_storage;
+}
+
+bool Mesh::intersect(const Ray &ray, HitRecord &rec) const
+{
+  TriangleRay triangle_ray(ray);
+  int entry = -1;
+  glm::vec2 uv;
+  auto intersect = [&](int first, int count, const Ray &r, HitRecord &record) {
+    float t;
+    if (!intersect_leaf(triangle_ray, first, count, r.t_max, t, uv, entry))
     {
-      output_box = BBox(v, v);
-      first_box = false;
+      return false;
     }
-    else
+    record.t = t;
+    return true;
+  };
+  if (!m_bvh.hit_leaves(ray, rec, intersect))
+  {
+    return false;
+  }
+  rec.object_id = m_id;
+  rec.primitive_id =
+      m_blocks[entry / TRIANGLE_BLOCK_SIZE].triangle[entry % TRIANGLE_BLOCK_SIZE];
+  rec.uv = uv;
+  return true;
+}
+
+void Mesh::fill_hit(const Ray &ray, HitRecord &rec) const
+{
+  size_t i = static_cast<size_t>(rec.primitive_id) * 3;
+  const auto &v0 = m_vertices[m_indices[i]];
+  const auto &v1 = m_vertices[m_indices[i + 1]];
+  const auto &v2 = m_vertices[m_indices[i + 2]];
+  rec.p = ray.at(rec.t);
+  auto normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+
+  rec.normal = glm::dot(normal, ray.direction()) > 0 ? -normal : normal;
+
+  rec.material_id = m_material_id;
+}
+
+bool Mesh::occluded(const Ray &r, float t_max) const
+{
+  Ray ray = r;
+  ray.t_max = std::min(ray.t_max, t_max);
+  TriangleRay triangle_ray(ray);
+  return m_bvh.occluded_leaves(
+      ray, [&](int first, int count, const Ray &segment) {
+        float t;
+        glm::vec2 uv;
+        int entry;
+        return intersect_leaf(triangle_ray, first, count, segment.t_max, t,
+                              uv, entry);
+      });
+}
+
+bool Mesh::intersect_leaf(const TriangleRay &ray, int first, int count,
+                          float t_max, float &t, glm::vec2 &uv,
+                          int &entry) const
+{
+  bool hit = false;
+  // a leaf need not start or end on a block boundary, lanes of other
+  // leaves are masked out
+  int end = first + count;
+  for (int block = first / TRIANGLE_BLOCK_SIZE;
+       block * TRIANGLE_BLOCK_SIZE < end; block++)
+  {
+    int begin = block * TRIANGLE_BLOCK_SIZE;
+    int lo = std::max(first - begin, 0);
+    int hi = std::min(end - begin, TRIANGLE_BLOCK_SIZE);
+    unsigned mask = ((1u << hi) - 1) & ~((1u << lo) - 1);
+    int lane = intersect_triangles(m_blocks[block], ray, mask, t_max, t, uv);
+    if (lane >= 0)
     {
-      output_box.expand(v);
+      t_max = t;
+      entry = begin + lane;
+      hit = true;
     }
   }
-  return output_box;
+  return hit;
+}
+
+BBox Mesh::bbox() const
+{
+  return m_bvh.bbox();
 }
 
 glm::vec3 Mesh::sample(const HitRecord &rec, Sampler *sampler) const
 {
-  auto index = static_cast<size_t>(sampler->get_1d() * (m_indices.size() / 3));
+  float pmf;
+  int triangle = triangle_table().sample(sampler->get_1d(), pmf);
+  return sample_triangle(triangle, rec, sampler);
+}
+
+glm::vec3 Mesh::sample_triangle(int triangle, const HitRecord &rec,
+                                Sampler *sampler) const
+{
+  size_t index = static_cast<size_t>(triangle) * 3;
   const auto &v0 = m_vertices[m_indices[index]];
   const auto &v1 = m_vertices[m_indices[index + 1]];
   const auto &v2 = m_vertices[m_indices[index + 2]];
-  auto u = sampler->get_1d();
-  auto v = sampler->get_1d();
+  auto r = sampler->get_2d();
+  auto u = r.x;
+  auto v = r.y;
   if (u + v > 1)
   {
     u = 1 - u;
@@ -320,6 +532,42 @@ glm::vec3 Mesh::sample(const HitRecord &rec, Sampler *sampler) const
   return glm::normalize(p - rec.p);
 }
 
+float Mesh::triangle_pdf(int triangle, const HitRecord &rec,
+                         const glm::vec3 &dir) const
+{
+  Ray ray(rec.p, dir);
+  size_t index = static_cast<size_t>(triangle) * 3;
+  const auto &v0 = m_vertices[m_indices[index]];
+  const auto &v1 = m_vertices[m_indices[index + 1]];
+  const auto &v2 = m_vertices[m_indices[index + 2]];
+  float t;
+  glm::vec2 uv;
+  if (!intersect_triangle(TriangleRay(ray), v0, v1, v2, ray.t_max, t, uv))
+  {
+    return 0.0f;
+  }
+  glm::vec3 normal = glm::cross(v1 - v0, v2 - v0);
+  // |dir . normal| is the cosine times twice the area
+  float cosine_area = glm::abs(glm::dot(dir, normal)) / 2.0f;
+  return cosine_area > 0.0f ? t * t / cosine_area : 0.0f;
+}
+
+const AliasTable &Mesh::triangle_table() const
+{
+  std::call_once(m_triangle_table_once, [this]() {
+    std::vector<float> areas(m_indices.size() / 3);
+    for (size_t i = 0; i < areas.size(); i++)
+    {
+      const auto &v0 = m_vertices[m_indices[3 * i]];
+      const auto &v1 = m_vertices[m_indices[3 * i + 1]];
+      const auto &v2 = m_vertices[m_indices[3 * i + 2]];
+      areas[i] = glm::length(glm::cross(v1 - v0, v2 - v0));
+    }
+    m_triangle_table = AliasTable(areas);
+  });
+  return m_triangle_table;
+}
+
 float Mesh::pdf(const HitRecord &rec, const glm::vec3 &dir) const
 {
   HitRecord test_rec;
@@ -332,3 +580,71 @@ float Mesh::pdf(const HitRecord &rec, const glm::vec3 &dir) const
   auto cosine = glm::abs(glm::dot(dir, test_rec.normal));
   return distance_squared / (cosine * area);
 }
+
+
+Instance::Instance(std::shared_ptr<const Hittable> object,
+                   const Transform &transform, std::shared_ptr<Material> mat)
+    : m_object(std::move(object)), m_transform(transform), m_material(mat)
+{
+  // bound the transformed corners of the object's box
+  auto box = m_object->bbox();
+  for (int i = 0; i < 8; i++)
+  {
+    glm::vec3 corner((i & 1) ? box.max().x : box.min().x,
+                     (i & 2) ? box.max().y : box.min().y,
+                     (i & 4) ? box.max().z : box.min().z);
+    m_bbox.expand(m_transform.point_to_world(corner));
+  }
+}
+
+bool Instance::intersect(const Ray &r, HitRecord &rec) const
+{
+  if (!intersect_primitive(*m_object, to_local(r), rec))
+  {
+    return false;
+  }
+  rec.object_id = m_id;
+  return true;
+}
+
+void Instance::fill_hit(const Ray &r, HitRecord &rec) const
+{
+  Ray local = to_local(r);
+  visit_primitive(*m_object,
+                  [&](const auto &object) { object.fill_hit(local, rec); });
+  rec.p = r.at(rec.t);
+  rec.normal = glm::normalize(m_transform.normal_to_world(rec.normal));
+  rec.material_id = m_material_id;
+}
+
+bool Instance::occluded(const Ray &r, float t_max) const
+{
+  return occluded_primitive(*m_object, to_local(r), t_max);
+}
+
+glm::vec3 Instance::sample(const HitRecord &rec, Sampler *sampler) const
+{
+  HitRecord local = rec;
+  local.p = m_transform.point_to_local(rec.p);
+  auto dir = m_object->sample(local, sampler);
+  return glm::normalize(m_transform.vector_to_world(dir));
+}
+
+float Instance::pdf(const HitRecord &rec, const glm::vec3 &dir) const
+{
+  HitRecord local = rec;
+  local.p = m_transform.point_to_local(rec.p);
+  return m_object->pdf(local,
+                       glm::normalize(m_transform.vector_to_local(dir)));
+}
+
+float Instance::surface_area() const
+{
+  // areas scale with the square of the transform's mean linear scale, exact
+  // for uniform scales
+  float volume = glm::abs(glm::dot(
+      m_transform.vector_to_world(glm::vec3(1.0f, 0.0f, 0.0f)),
+      glm::cross(m_transform.vector_to_world(glm::vec3(0.0f, 1.0f, 0.0f)),
+                 m_transform.vector_to_world(glm::vec3(0.0f, 0.0f, 1.0f)))));
+  return m_object->surface_area() * std::pow(volume, 2.0f / 3.0f);
+}
\ No newline at end of file
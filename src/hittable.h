@@ -1,20 +1,60 @@
 #pragma once
+#include "accel.h"
+#include "alias_table.h"
 #include "bbox.h"
+#include "fingerprint.h"
+#include "light_bvh.h"
 #include "material.h"
 #include "ray.h"
 #include "record.h"
-#include "uuid.h"
+#include "transform.h"
+#include "triangle.h"
+#include "wide_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <memory>
-#include <optional>
+#include <mutex>
+#include <span>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+// concrete type of a primitive, see visit_primitive
+enum class PrimitiveType {
+  Sphere,
+  Mesh,
+  Custom,
+};
+
 class Hittable {
 public:
+  Hittable() = default;
   virtual ~Hittable() {}
-  virtual bool hit(const Ray &r, HitRecord &rec) const = 0;
+  PrimitiveType primitive_type() const { return m_primitive_type; }
+  // closest hit in (r.t_min, r.t_max) nearer than rec.t, with all of its
+  // attributes
+  bool hit(const Ray &r, HitRecord &rec) const;
+  // What traversal calls for every candidate: finds the same hit as hit,
+  // but only records its t, object_id, primitive_id and uv, as a closer
+  // object found later would overwrite anything more.
+  virtual bool intersect(const Ray &r, HitRecord &rec) const = 0;
+  // p, normal and material_id of the hit recorded by intersect
+  virtual void fill_hit(const Ray &r, HitRecord &rec) const = 0;
+  // whether anything is hit between r.t_min and t_max, for shadow rays;
+  // overrides stop at the first hit found and compute no hit attributes
+  virtual bool occluded(const Ray &r, float t_max) const {
+    Ray ray = r;
+    ray.t_max = std::min(ray.t_max, t_max);
+    HitRecord rec;
+    return intersect(ray, rec);
+  }
   virtual BBox bbox() const = 0;
-  virtual std::optional<std::string> id() const { return std::nullopt; }
+  // handles assigned by Scene::add
+  int id() const { return m_id; }
+  int material_id() const { return m_material_id; }
+  void set_id(int id) { m_id = id; }
+  void set_material_id(int id) { m_material_id = id; }
   virtual std::shared_ptr<Material> material() const { return nullptr; }
   virtual glm::vec3 sample(const HitRecord &rec, Sampler *sampler) const {
     return glm::vec3(0.0f);
@@ -22,15 +62,34 @@ public:
   virtual float pdf(const HitRecord &rec, const glm::vec3 &dir) const {
     return 0.0f;
   }
+  // weighs lights by the power they emit, 0 if unknown
+  virtual float surface_area() const { return 0.0f; }
+  // adds the geometry to hash, for checkpoint keys; custom primitives only
+  // add their bounds
+  virtual void fingerprint(Fingerprint &hash) const {
+    BBox box = bbox();
+    hash.add(box.min());
+    hash.add(box.max());
+  }
+
+protected:
+  // for the built-in primitives
+  explicit Hittable(PrimitiveType type) : m_primitive_type(type) {}
+
+  int m_id = -1;
+  int m_material_id = -1;
+  PrimitiveType m_primitive_type = PrimitiveType::Custom;
 };
 
-class Sphere : public Hittable {
+class Sphere final : public Hittable {
 public:
-  Sphere() : m_id(uuid::generate_uuid_v4()) {}
+  Sphere() : Hittable(PrimitiveType::Sphere) {}
   Sphere(glm::vec3 cen, float r, std::shared_ptr<Material> mat)
-      : center(cen), radius(r), m_id(uuid::generate_uuid_v4()),
+      : Hittable(PrimitiveType::Sphere), center(cen), radius(r),
         m_material(mat){};
-  virtual bool hit(const Ray &r, HitRecord &rec) const;
+  virtual bool intersect(const Ray &r, HitRecord &rec) const override;
+  virtual void fill_hit(const Ray &r, HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, float t_max) const override;
   virtual BBox bbox() const override {
     return BBox(center - glm::vec3(radius), center + glm::vec3(radius));
   }
@@ -38,16 +97,25 @@ public:
   virtual std::shared_ptr<Material> material() const override {
     return m_material;
   }
-  virtual std::optional<std::string> id() const override { return m_id; }
 
   virtual glm::vec3 sample(const HitRecord &rec,
                            Sampler *sampler) const override;
   virtual float pdf(const HitRecord &rec, const glm::vec3 &dir) const override;
+  virtual float surface_area() const override {
+    return 4.0f * glm::pi<float>() * radius * radius;
+  }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(center);
+    hash.add(radius);
+  }
 
   glm::vec3 center;
   float radius;
-  std::string m_id;
   std::shared_ptr<Material> m_material = nullptr;
+
+private:
+  // nearest intersection distance in (r.t_min, t_max)
+  bool intersect(const Ray &r, float t_max, float &t) const;
 };
 
 class Scene : public Hittable {
@@ -56,41 +124,115 @@ public:
   void build();
   void build_accel();
 
-  void add(std::unique_ptr<Hittable> h) { list.push_back(std::move(h)); }
-  virtual bool hit(const Ray &r, HitRecord &rec) const override;
+  void add(std::unique_ptr<Hittable> h);
+  virtual bool intersect(const Ray &r, HitRecord &rec) const override;
+  virtual void fill_hit(const Ray &r, HitRecord &rec) const override;
+  using Hittable::hit;
+  void hit(const RayPacket &packet, HitRecord *records, bool *hits) const;
+  virtual bool occluded(const Ray &r, float t_max) const override;
+  // whether each ray of a packet is occluded before its own t_max
+  void occluded(const RayPacket &packet, bool *blocked) const;
 
   virtual BBox bbox() const override;
+  // every object with its material
+  virtual void fingerprint(Fingerprint &hash) const override;
 
-  const std::unique_ptr<Hittable> &get(const std::string &id) const {
-    for (const auto &h : list) {
-      if (h->id() && h->id() == id) {
-        return h;
-      }
-    }
-    throw std::runtime_error("No hittable with id " + id);
+  const std::unique_ptr<Hittable> &get(int id) const { return list[id]; }
+
+  const Material *material(int id) const { return materials[id].get(); }
+  // kept apart from the materials so shading can dispatch on it without a
+  // virtual call, see visit_material
+  MaterialType material_type(int id) const { return m_material_types[id]; }
+
+  // One light for light sampling: an emissive object, or a single triangle
+  // of an emissive mesh, which are split so that each triangle is sampled
+  // by its own importance.
+  struct Emitter {
+    int id;
+    // -1 for the whole object
+    int triangle;
+  };
+
+  // Picks an emitter by its estimated contribution to point p with surface
+  // normal n, from u in [0, 1), through the light hierarchy. Returns its
+  // index and sets pmf to its probability, or returns -1 if no light can
+  // reach p. Valid after build().
+  int sample_light(const glm::vec3 &p, const glm::vec3 &n, float u,
+                   float &pmf) const;
+  // probability that sample_light picks the emitter for p and n
+  float light_pmf(const glm::vec3 &p, const glm::vec3 &n, int emitter) const {
+    return m_light_bvh.pmf(p, n, emitter);
   }
+  // the emitter hit at rec, -1 if it is not a light
+  int emitter_at(const HitRecord &rec) const;
+  const Emitter &emitter(int index) const { return m_emitters[index]; }
+  // direction from rec toward a point on the emitter and its solid angle
+  // pdf, like Hittable::sample and pdf
+  glm::vec3 sample_emitter(int emitter, const HitRecord &rec,
+                           Sampler *sampler) const;
+  float emitter_pdf(int emitter, const HitRecord &rec,
+                    const glm::vec3 &dir) const;
 
+  // loads an OBJ file, through the scene cache next to it while that is
+  // up to date
   static std::unique_ptr<Scene> from_file(const std::string &filename);
 
   std::vector<std::unique_ptr<Hittable>> list;
-  std::vector<std::string> lights;
+  std::vector<std::shared_ptr<Material>> materials;
+  std::vector<int> lights;
   std::unique_ptr<class Accel> accel = nullptr;
+#if defined(__AVX__)
+  AccelType accel_type = AccelType::BVH8;
+#else
+  AccelType accel_type = AccelType::BVH4;
+#endif
+  SplitMethod split_method = SplitMethod::SAH;
+
+private:
+  int add_material(const std::shared_ptr<Material> &material);
+  void build_lights();
+
+  std::unordered_map<const Material *, int> m_material_ids;
+  std::vector<MaterialType> m_material_types;
+  std::vector<Emitter> m_emitters;
+  // first emitter of every object by id, -1 for objects that are not lights
+  std::vector<int> m_emitter_offsets;
+  LightBVH m_light_bvh;
 };
 
-class Mesh : public Hittable {
+class Mesh final : public Hittable {
 public:
   Mesh(const std::vector<glm::vec3> vertices, const std::vector<int> indices,
        std::shared_ptr<Material> mat)
-      : m_vertices(vertices), m_indices(indices), m_material(mat) {
+      : Mesh(std::make_shared<const std::vector<glm::vec3>>(vertices), indices,
+             mat) {}
+  // meshes cut from one model can share its vertex buffer, each indexing
+  // only the triangles it owns
+  Mesh(std::shared_ptr<const std::vector<glm::vec3>> vertices,
+       std::vector<int> indices, std::shared_ptr<Material> mat)
+      : Hittable(PrimitiveType::Mesh), m_vertices(*vertices),
+        m_storage(std::move(vertices)),
+        m_index_storage(std::move(indices)), m_material(mat) {
+    m_indices = m_index_storage;
     area = compute_area();
+    build_bvh();
   }
+  // a mesh built before, e.g. read from a scene cache, whose buffers and
+  // hierarchy point into memory kept alive by storage
+  Mesh(std::shared_ptr<const void> storage,
+       std::span<const glm::vec3> vertices, std::span<const int> indices,
+       WideBVHTree<4> bvh, std::span<const TriangleBlock> blocks, float area,
+       std::shared_ptr<Material> mat)
+      : Hittable(PrimitiveType::Mesh), m_vertices(vertices),
+        m_indices(indices), m_storage(std::move(storage)),
+        m_material(mat), m_bvh(std::move(bvh)), m_blocks(blocks), area(area) {}
 
-  virtual bool hit(const Ray &r, HitRecord &rec) const override;
+  virtual bool intersect(const Ray &r, HitRecord &rec) const override;
+  virtual void fill_hit(const Ray &r, HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, float t_max) const override;
 
   virtual BBox bbox() const override;
 
-  virtual std::optional<std::string> id() const override { return m_id; }
-
   virtual std::shared_ptr<Material> material() const override {
     return m_material;
   }
@@ -99,7 +241,37 @@ public:
                            Sampler *sampler) const override;
   virtual float pdf(const HitRecord &rec, const glm::vec3 &dir) const override;
 
+  // light sampling of a single triangle, for meshes split into one
+  // emitter per triangle
+  glm::vec3 sample_triangle(int triangle, const HitRecord &rec,
+                            Sampler *sampler) const;
+  float triangle_pdf(int triangle, const HitRecord &rec,
+                     const glm::vec3 &dir) const;
+
+  std::span<const glm::vec3> vertices() const { return m_vertices; }
+  std::span<const int> indices() const { return m_indices; }
+  const WideBVHTree<4> &bvh() const { return m_bvh; }
+  std::span<const TriangleBlock> triangle_blocks() const { return m_blocks; }
+  virtual float surface_area() const override { return area; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(m_vertices);
+    hash.add(m_indices);
+  }
+
 private:
+  // the triangle hierarchy is built once here and shared by every render
+  void build_bvh();
+
+  // picks triangles by area for sample, built on first use as few meshes
+  // are ever sampled
+  const AliasTable &triangle_table() const;
+  // Nearest triangle of a leaf, entries first to first + count of the
+  // hierarchy's index_data(), closer than t_max. Sets t, the barycentric
+  // uv and its entry.
+  bool intersect_leaf(const TriangleRay &ray, int first, int count,
+                      float t_max, float &t, glm::vec2 &uv,
+                      int &entry) const;
+
   float compute_area() const {
     float area = 0.0f;
     for (size_t i = 0; i < m_indices.size(); i += 3) {
@@ -111,9 +283,123 @@ private:
     return area;
   }
 
-  std::vector<glm::vec3> m_vertices;
-  std::vector<int> m_indices;
+  std::span<const glm::vec3> m_vertices;
+  std::span<const int> m_indices;
+  // owns the vertices (and, for cached meshes, everything else) unless the
+  // indices are in m_index_storage
+  std::shared_ptr<const void> m_storage;
+  std::vector<int> m_index_storage;
   std::shared_ptr<Material> m_material = nullptr;
-  std::string m_id = uuid::generate_uuid_v4();
+  WideBVHTree<4> m_bvh;
+  // vertices of the triangles in the order of the hierarchy's index_data(),
+  // so every leaf covers consecutive lanes
+  std::span<const TriangleBlock> m_blocks;
+  std::vector<TriangleBlock> m_block_storage;
   float area;
+  mutable std::once_flag m_triangle_table_once;
+  mutable AliasTable m_triangle_table;
+};
+
+// Places shared geometry in the scene with an object to world transform, so
+// memory grows with the number of unique assets rather than placements. The
+// geometry is never added to the scene itself.
+class Instance : public Hittable {
+public:
+  Instance(std::shared_ptr<const Hittable> object, const Transform &transform,
+           std::shared_ptr<Material> mat = nullptr);
+
+  virtual bool intersect(const Ray &r, HitRecord &rec) const override;
+  virtual void fill_hit(const Ray &r, HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, float t_max) const override;
+
+  virtual BBox bbox() const override { return m_bbox; }
+
+  virtual std::shared_ptr<Material> material() const override {
+    return m_material ? m_material : m_object->material();
+  }
+
+  // light sampling assumes a rigid transform, scaling changes solid angles
+  virtual glm::vec3 sample(const HitRecord &rec,
+                           Sampler *sampler) const override;
+  virtual float pdf(const HitRecord &rec, const glm::vec3 &dir) const override;
+  virtual float surface_area() const override;
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(m_transform);
+    m_object->fingerprint(hash);
+  }
+
+private:
+  std::shared_ptr<const Hittable> m_object;
+  Transform m_transform;
+  std::shared_ptr<Material> m_material;
+  BBox m_bbox;
+
+  // the ray in object space; the direction is not renormalized, so t is
+  // the same in both spaces
+  Ray to_local(const Ray &r) const {
+    Ray local(m_transform.point_to_local(r.origin()),
+              m_transform.vector_to_local(r.direction()));
+    local.t_min = r.t_min;
+    local.t_max = r.t_max;
+    return local;
+  }
 };
+
+// Calls f with object as its concrete type, like visit_material. Sphere and
+// Mesh are final, so their intersection code binds statically and can be
+// inlined into traversal; instances, scenes and custom primitives are passed
+// as Hittable.
+template <typename F>
+decltype(auto) visit_primitive(const Hittable &object, F &&f) {
+  switch (object.primitive_type()) {
+  case PrimitiveType::Sphere:
+    return f(static_cast<const Sphere &>(object));
+  case PrimitiveType::Mesh:
+    return f(static_cast<const Mesh &>(object));
+  default:
+    return f(object);
+  }
+}
+
+// the intersection tests through visit_primitive, for traversal callbacks
+inline bool intersect_primitive(const Hittable &object, const Ray &r,
+                                HitRecord &rec) {
+  return visit_primitive(
+      object, [&](const auto &o) { return o.intersect(r, rec); });
+}
+
+// intersect_primitive for traversal over the objects of a scene. A hit at
+// exactly the distance of the closest one so far replaces it if its object
+// has a lower id, so the hit found does not depend on the order objects are
+// visited in, which differs between single rays and packets.
+inline bool intersect_closest(const Hittable &object, const Ray &r,
+                              HitRecord &rec) {
+  if (rec.object_id <= object.id() || rec.t > r.t_max) {
+    return intersect_primitive(object, r, rec);
+  }
+  HitRecord closest = rec;
+  Ray ray = r;
+  ray.t_max = rec.t =
+      std::nextafter(closest.t, std::numeric_limits<float>::infinity());
+  if (intersect_primitive(object, ray, rec)) {
+    return true;
+  }
+  rec = closest;
+  return false;
+}
+
+inline bool occluded_primitive(const Hittable &object, const Ray &r,
+                               float t_max) {
+  return visit_primitive(
+      object, [&](const auto &o) { return o.occluded(r, t_max); });
+}
+
+inline bool Hittable::hit(const Ray &r, HitRecord &rec) const {
+  return visit_primitive(*this, [&](const auto &object) {
+    if (!object.intersect(r, rec)) {
+      return false;
+    }
+    object.fill_hit(r, rec);
+    return true;
+  });
+}
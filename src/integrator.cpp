@@ -2,115 +2,249 @@
 #include "record.h"
 #include "sampling.h"
 #include <memory>
-#include "pdf.h"
-glm::vec3 TestIntegrator::li(const Ray &ray, const Scene &scene,Sampler* sampler,
-                             int depth) const {
-  if (depth < 0) {
-    return glm::vec3(0.0f);
+
+bool Integrator::survives_roulette(glm::vec3 &throughput, int bounce,
+                                   Sampler *sampler) {
+  float survival =
+      std::max(throughput.x, std::max(throughput.y, throughput.z));
+  if (bounce < ROULETTE_MIN_BOUNCES || survival >= 1.0f) {
+    return true;
   }
-  HitRecord rec;
-  if (scene.hit(ray, rec)) {
+  if (sampler->get_1d() >= survival) {
+    return false;
+  }
+  throughput /= survival;
+  return true;
+}
 
+glm::vec3 TestIntegrator::li(const Ray &ray, const HitRecord *hit,
+                             const Scene &scene, Sampler *sampler,
+                             int depth) const {
+  glm::vec3 throughput(1.0f);
+  Ray current = ray;
+  HitRecord rec;
+  bool found = hit != nullptr;
+  if (found) {
+    rec = *hit;
+  }
+  for (int bounce = 0; bounce <= depth; bounce++) {
+    if (!found) {
+      glm::vec3 unit_direction = glm::normalize(current.direction());
+      float t = 0.5f * (unit_direction.y + 1.0f);
+      return throughput * ((1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) +
+                           t * glm::vec3(0.5f, 0.7f, 1.0f));
+    }
     // return (rec.normal + glm::vec3(1.0f, 1.0f, 1.0f)) * 0.5f;
-    const auto &object = scene.get(rec.object_id.value());
     glm::vec3 attenuation;
     Ray scattered;
     float ignore;
-    if (object->material()->scatter(ray, rec, attenuation, scattered, ignore)) {
-      return attenuation * li(scattered, scene,sampler, depth - 1);
+    bool scatters = visit_material(
+        scene.material_type(rec.material_id), *scene.material(rec.material_id),
+        [&](const auto &material) {
+          return material.scatter(current, rec, attenuation, scattered, ignore,
+                                  sampler);
+        });
+    if (!scatters) {
+      return throughput * attenuation;
+    }
+    throughput *= attenuation;
+    if (bounce == depth || !survives_roulette(throughput, bounce, sampler)) {
+      break;
     }
-    return attenuation;
+    current = scattered;
+    rec = HitRecord();
+    found = scene.hit(current, rec);
   }
-
-  glm::vec3 unit_direction = glm::normalize(ray.direction());
-  float t = 0.5f * (unit_direction.y + 1.0f);
-  return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) +
-         t * glm::vec3(0.5f, 0.7f, 1.0f);
+  return glm::vec3(0.0f);
 }
 
-glm::vec3 WhitIntegrator::li(const Ray &ray, const Scene &scene,Sampler* sampler,
+glm::vec3 WhitIntegrator::li(const Ray &ray, const HitRecord *hit,
+                             const Scene &scene, Sampler *sampler,
                              int depth) const {
-  if (depth < 0) {
-    return glm::vec3(0.0f);
-  }
+  glm::vec3 result(0.0f);
+  glm::vec3 throughput(1.0f);
+  Ray current = ray;
   HitRecord rec;
-  if (!scene.hit(ray, rec)) {
-    return glm::vec3(0.0f);
+  bool found = hit != nullptr;
+  if (found) {
+    rec = *hit;
   }
-  const auto &object = scene.get(rec.object_id.value());
-  glm::vec3 attenuation;
-  Ray scattered;
-  float ignore;
-  glm::vec3 emitted = object->material()->emitted(ray, rec);
-
-  if (object->material()->scatter(ray, rec, attenuation, scattered, ignore)) {
-    return emitted + attenuation * li(scattered, scene, sampler, depth - 1);
+  for (int bounce = 0; found && bounce <= depth; bounce++) {
+    glm::vec3 attenuation;
+    Ray scattered;
+    float ignore;
+    bool scatters = visit_material(
+        scene.material_type(rec.material_id), *scene.material(rec.material_id),
+        [&](const auto &material) {
+          result += throughput * material.emitted(current, rec);
+          return material.scatter(current, rec, attenuation, scattered, ignore,
+                                  sampler);
+        });
+    if (!scatters) {
+      break;
+    }
+    throughput *= attenuation;
+    if (bounce == depth || !survives_roulette(throughput, bounce, sampler)) {
+      break;
+    }
+    current = scattered;
+    rec = HitRecord();
+    found = scene.hit(current, rec);
   }
-
-  return emitted;
+  return result;
 }
 
-glm::vec3 PathIntegrator::li(const Ray &ray, const Scene &scene, Sampler* sampler, 
+// Each non specular hit connects to a light sampled by its importance (next
+// event estimation) and continues along a BSDF sample. Light reached either
+// way is weighted with the power heuristic, so each strategy counts where it
+// has the lower variance: light sampling for small, bright lights and BSDF
+// sampling for large lights and glossy lobes.
+glm::vec3 PathIntegrator::li(const Ray &ray, const HitRecord *hit,
+                             const Scene &scene, Sampler *sampler,
                              int depth) const {
-    if (depth <= 0) {
-      return glm::vec3(0.0, 0.0, 0.0);
-    }
-    HitRecord record;
-    if (!scene.hit(ray, record)) {
-      return glm::vec3(0.0, 0.0, 0.0);
-    }
-    const auto& object = scene.get(record.object_id.value());
-    const auto& material = object->material();
+  glm::vec3 result(0.0f);
+  glm::vec3 throughput(1.0f);
+  Ray current = ray;
+  HitRecord record;
+  bool found = hit != nullptr;
+  if (found) {
+    record = *hit;
+  }
+  // pdf of the BSDF sample current was made by and the normal where it was
+  // taken, see emission_weight; emission seen directly from the camera is
+  // not weighted
+  float bsdf_pdf = 0.0f;
+  glm::vec3 normal(0.0f);
+  for (int bounce = 0; found && bounce < depth; bounce++) {
     Ray scattered;
-    glm::vec3 attenuation;
-
-    glm::vec3 emitted = material->emitted(ray, record);
-    float pdf;
-    if (!material->scatter(ray, record, attenuation, scattered, pdf)) {
-      return emitted;
+    // the material calls bind statically for the built-in materials; returns
+    // whether the path goes on from this hit
+    auto shade = [&](const auto &material) {
+      glm::vec3 emitted = material.emitted(current, record);
+      if (emitted != glm::vec3(0.0f)) {
+        result += throughput * emitted *
+                  emission_weight(current, record, scene, bsdf_pdf, normal);
+      }
+      glm::vec3 attenuation;
+      float pdf;
+      if (!material.scatter(current, record, attenuation, scattered, pdf,
+                            sampler)) {
+        return false;
+      }
+      // light found by the BSDF sample is only counted while the path may
+      // continue, so light sampling stops there as well
+      bool last = bounce + 1 == depth;
+      if (material.is_specular()) {
+        throughput *= attenuation;
+        bsdf_pdf = 0.0f;
+      } else {
+        LightSample light;
+        if (!last &&
+            sample_light(record, scattered.origin(), scene, sampler, light)) {
+          float scattering =
+              material.scattering_pdf(current, record, light.ray);
+          if (scattering > 0.0f &&
+              !scene.occluded(light.ray, light.distance)) {
+            result += throughput * attenuation * scattering * light.radiance *
+                      power_heuristic(light.pdf, scattering) / light.pdf;
+          }
+        }
+        if (pdf <= 0.0f) {
+          return false;
+        }
+        throughput *= material.scattering_pdf(current, record, scattered) *
+                      attenuation / pdf;
+        bsdf_pdf = pdf;
+      }
+      return !last && survives_roulette(throughput, bounce, sampler);
+    };
+    if (!visit_material(scene.material_type(record.material_id),
+                        *scene.material(record.material_id), shade)) {
+      break;
     }
+    normal = record.normal;
+    current = scattered;
+    record = HitRecord();
+    found = scene.hit(current, record);
+  }
+  return result;
+}
 
-
-    const auto& light = scene.get(scene.lights[0]);
-    HitablePDF p0(light);
-    CosinePDF p1;
-    MixPDF mix_pdf(&p0, &p1);
-    scattered = Ray(record.p, mix_pdf.sample(record, sampler));
-    pdf = mix_pdf.value(record, scattered.direction());
-
-    if (pdf > 0.0f) {
-      return emitted + material->scattering_pdf(ray, record, scattered) * attenuation  * li(scattered, scene, sampler, depth - 1) / pdf;
-    }
-    // scattered = Ray(record.p, sample_lights(record, scene, sampler, pdf));
-    return emitted;
-  
+bool PathIntegrator::sample_light(const HitRecord &record,
+                                  const glm::vec3 &origin, const Scene &scene,
+                                  Sampler *sampler,
+                                  LightSample &sample) const {
+  // sampled from the same point as emission_weight evaluates it for BSDF
+  // samples, so the two weights add up to one
+  float pmf;
+  int emitter =
+      scene.sample_light(origin, record.normal, sampler->get_1d(), pmf);
+  if (emitter < 0) {
+    return false;
+  }
+  HitRecord from = record;
+  from.p = origin;
+  glm::vec3 direction = scene.sample_emitter(emitter, from, sampler);
+  sample.pdf = pmf * scene.emitter_pdf(emitter, from, direction);
+  if (sample.pdf <= 0.0f) {
+    return false;
+  }
+  sample.ray = Ray(origin, direction);
+  // another triangle of the same mesh in front occludes the sampled one
+  HitRecord light_record;
+  if (!scene.get(scene.emitter(emitter).id)->hit(sample.ray, light_record) ||
+      scene.emitter_at(light_record) != emitter) {
+    return false;
   }
+  // stop short of the light so that it does not occlude itself
+  sample.distance = light_record.t * (1.0f - SHADOW_EPSILON);
+  int id = light_record.material_id;
+  sample.radiance = visit_material(
+      scene.material_type(id), *scene.material(id),
+      [&](const auto &material) {
+        return material.emitted(sample.ray, light_record);
+      });
+  return sample.radiance != glm::vec3(0.0f);
+}
 
-glm::vec3 PathIntegrator::sample_lights(const HitRecord &record,
-                          const Scene &scene, Sampler* sampler, float& pdf) const {
-                            auto light_index = sampler->get_1d() * scene.lights.size();
-                            auto light_id = scene.lights[light_index];
-                            const auto& light = scene.get(light_id);
-                            auto light_dir = light->sample(record, sampler);
-                            auto light_pdf = light->pdf(record, light_dir);
-                            pdf = light_pdf / (float)scene.lights.size();
-                            return light_dir;
-                          }
+float PathIntegrator::emission_weight(const Ray &ray, const HitRecord &record,
+                                      const Scene &scene, float bsdf_pdf,
+                                      const glm::vec3 &normal) const {
+  if (bsdf_pdf <= 0.0f) {
+    return 1.0f;
+  }
+  int emitter = scene.emitter_at(record);
+  if (emitter < 0) {
+    return 1.0f;
+  }
+  // the pdf light sampling would have had from where the ray started
+  float pmf = scene.light_pmf(ray.origin(), normal, emitter);
+  if (pmf <= 0.0f) {
+    return 1.0f;
+  }
+  HitRecord origin;
+  origin.p = ray.origin();
+  origin.normal = normal;
+  float light_pdf =
+      pmf * scene.emitter_pdf(emitter, origin, ray.direction());
+  return power_heuristic(bsdf_pdf, light_pdf);
+}
 
-glm::vec3 NormalIntegrator::li(const Ray &ray, const Scene &scene,Sampler* sampler,
-                               int depth) const {
-  HitRecord rec;
-  if (!scene.hit(ray, rec)) {
+glm::vec3 NormalIntegrator::li(const Ray & /*ray*/, const HitRecord *rec,
+                               const Scene & /*scene*/,
+                               Sampler * /*sampler*/, int /*depth*/) const {
+  if (!rec) {
     return glm::vec3(0.0f);
   }
-  return (rec.normal + glm::vec3(1.0f, 1.0f, 1.0f)) * 0.5f;
+  return (rec->normal + glm::vec3(1.0f, 1.0f, 1.0f)) * 0.5f;
 }
 
-glm::vec3 VisibilityIntegrator::li(const Ray &ray, const Scene &scene,Sampler* sampler,
-                                   int depth) const {
-  HitRecord rec;
-  if (scene.hit(ray, rec)) {
-    if (glm::dot(ray.direction(), rec.normal) < 0.0f) {
+glm::vec3 VisibilityIntegrator::li(const Ray &ray, const HitRecord *rec,
+                                   const Scene & /*scene*/,
+                                   Sampler * /*sampler*/,
+                                   int /*depth*/) const {
+  if (rec) {
+    if (glm::dot(ray.direction(), rec->normal) < 0.0f) {
       return glm::vec3(1.0f);
     }
     return glm::vec3(0.0f);
@@ -5,38 +5,92 @@
 #include "sampler.h"
 class Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene, Sampler* sampler, int depth) const = 0;
+  virtual glm::vec3 li(const Ray &ray, const Scene &scene, Sampler* sampler, int depth) const {
+    HitRecord rec;
+    bool hit = scene.hit(ray, rec);
+    return li(ray, hit ? &rec : nullptr, scene, sampler, depth);
+  }
+  // radiance along a ray whose closest hit is already known, so camera rays
+  // can be traced in packets; rec is nullptr if the ray hit nothing
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
+                       int depth) const = 0;
+
+protected:
+  // Russian roulette: from bounce ROULETTE_MIN_BOUNCES on, a path whose
+  // throughput has dropped below 1 goes on with that throughput as its
+  // probability, and survivors are scaled up to keep the estimate unbiased.
+  // Returns whether the path goes on.
+  static bool survives_roulette(glm::vec3 &throughput, int bounce,
+                                Sampler *sampler);
+  static constexpr int ROULETTE_MIN_BOUNCES = 3;
 };
 
 class TestIntegrator : public Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene,Sampler* sampler,
+  using Integrator::li;
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
                        int depth) const override;
 };
 
 class WhitIntegrator : public Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene,Sampler* sampler,
+  using Integrator::li;
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
                        int depth) const override;
 };
 
 class PathIntegrator : public Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene,Sampler* sampler,
+  using Integrator::li;
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
                        int depth) const override;
-private:
-  glm::vec3 sample_lights(const HitRecord &record,
-                          const Scene &scene, Sampler* sampler,  float& pdf) const;
+protected:
+  // Next event estimation: a light picked by its importance to record, a
+  // direction to it from origin, where rays leaving record start, and what
+  // arrives along it unless something is in the way.
+  struct LightSample {
+    // shadow ray toward the light, which is occluded if anything is hit
+    // before distance
+    Ray ray;
+    float distance;
+    glm::vec3 radiance;
+    // solid angle pdf of the direction, including the chance of the light
+    float pdf;
+  };
+  bool sample_light(const HitRecord &record, const glm::vec3 &origin,
+                    const Scene &scene, Sampler *sampler,
+                    LightSample &sample) const;
+  // multiple importance sampling weight of the emission at record, reached
+  // by a ray sampled from a BSDF with bsdf_pdf, 0 if it was not sampled, at
+  // a surface with the given normal
+  float emission_weight(const Ray &ray, const HitRecord &record,
+                        const Scene &scene, float bsdf_pdf,
+                        const glm::vec3 &normal) const;
+  // shadow rays end this fraction of the distance short of the light
+  static constexpr float SHADOW_EPSILON = 1e-4f;
+  static float power_heuristic(float pdf, float other_pdf) {
+    float f = pdf * pdf;
+    float g = other_pdf * other_pdf;
+    return f + g > 0.0f ? f / (f + g) : 0.0f;
+  }
 };
 
 class NormalIntegrator : public Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene,Sampler* sampler,
+  using Integrator::li;
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
                        int depth) const override;
 };
 
 class VisibilityIntegrator : public Integrator {
 public:
-  virtual glm::vec3 li(const Ray &ray, const Scene &scene,Sampler* sampler,
+  using Integrator::li;
+  virtual glm::vec3 li(const Ray &ray, const HitRecord *rec,
+                       const Scene &scene, Sampler *sampler,
                        int depth) const override;
 };
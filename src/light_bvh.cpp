@@ -0,0 +1,322 @@
+#include "light_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/constants.hpp>
+#include <limits>
+
+namespace {
+float safe_sqrt(float x) { return std::sqrt(std::max(x, 0.0f)); }
+float safe_acos(float x) { return std::acos(std::clamp(x, -1.0f, 1.0f)); }
+
+// angle between unit vectors, accurate for nearly (anti)parallel ones
+float angle_between(const glm::vec3 &a, const glm::vec3 &b) {
+  if (glm::dot(a, b) < 0.0f) {
+    return glm::pi<float>() -
+           2.0f * std::asin(std::min(glm::length(a + b) / 2.0f, 1.0f));
+  }
+  return 2.0f * std::asin(std::min(glm::length(b - a) / 2.0f, 1.0f));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of
+// angles a and b in [0, pi]
+float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) {
+    return 1.0f;
+  }
+  return cos_a * cos_b + sin_a * sin_b;
+}
+float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+  if (cos_a > cos_b) {
+    return 0.0f;
+  }
+  return sin_a * cos_b - cos_a * sin_b;
+}
+
+// cosine of the half angle of the cone of directions from p to the
+// bounding sphere of box, -1 if p is inside
+float subtended_cos(const BBox &box, const glm::vec3 &p) {
+  if (box.inside(p)) {
+    return -1.0f;
+  }
+  glm::vec3 to_center = box.center() - p;
+  float radius = glm::length(box.max() - box.min()) / 2.0f;
+  float sin2_theta_max =
+      radius * radius / glm::dot(to_center, to_center);
+  if (sin2_theta_max >= 1.0f) {
+    return -1.0f;
+  }
+  return safe_sqrt(1.0f - sin2_theta_max);
+}
+
+// solid angle measure of the directions a set of lights emits in, used as
+// the orientation term of the split cost
+float orientation_measure(const LightBounds &b) {
+  float theta_o = safe_acos(b.cos_theta_o);
+  float theta_e = safe_acos(b.cos_theta_e);
+  float theta_w = std::min(theta_o + theta_e, glm::pi<float>());
+  float sin_theta_o = safe_sqrt(1.0f - b.cos_theta_o * b.cos_theta_o);
+  return 2.0f * glm::pi<float>() * (1.0f - b.cos_theta_o) +
+         glm::pi<float>() / 2.0f *
+             (2.0f * theta_w * sin_theta_o - std::cos(theta_o - 2.0f * theta_w) -
+              2.0f * theta_o * sin_theta_o + b.cos_theta_o);
+}
+
+// cost of a child with lights b, in a node whose bounds have the given
+// diagonal split along axis; long thin children are penalized
+float split_cost(const LightBounds &b, const glm::vec3 &diagonal, int axis) {
+  float regularization =
+      std::max({diagonal.x, diagonal.y, diagonal.z}) / diagonal[axis];
+  return b.phi * orientation_measure(b) * regularization *
+         b.bounds.surface_area();
+}
+} // namespace
+
+float LightBounds::importance(const glm::vec3 &p, const glm::vec3 &n) const {
+  glm::vec3 center = bounds.center();
+  glm::vec3 offset = p - center;
+  float distance = glm::length(offset);
+  // clamped so points inside the bounds do not get unbounded importance
+  float d2 = std::max(distance * distance,
+                      glm::length(bounds.max() - bounds.min()) / 2.0f);
+  glm::vec3 wi = distance > 0.0f ? offset / distance : w;
+
+  float cos_theta_w = glm::dot(w, wi);
+  if (two_sided) {
+    cos_theta_w = std::abs(cos_theta_w);
+  }
+  float sin_theta_w = safe_sqrt(1.0f - cos_theta_w * cos_theta_w);
+  float cos_theta_b = subtended_cos(bounds, p);
+  float sin_theta_b = safe_sqrt(1.0f - cos_theta_b * cos_theta_b);
+  float sin_theta_o = safe_sqrt(1.0f - cos_theta_o * cos_theta_o);
+
+  // smallest angle between the direction to p and any direction light can
+  // leave in, over all points of the bounds
+  float cos_theta_x =
+      cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+  float sin_theta_x =
+      sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+  float cos_theta_p =
+      cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+  if (cos_theta_p <= cos_theta_e) {
+    return 0.0f;
+  }
+
+  float result = phi * cos_theta_p / d2;
+  if (n != glm::vec3(0.0f)) {
+    // largest cosine at the surface of any direction toward the bounds
+    float cos_theta_i = std::abs(glm::dot(wi, n));
+    float sin_theta_i = safe_sqrt(1.0f - cos_theta_i * cos_theta_i);
+    result *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b,
+                              cos_theta_b);
+  }
+  return std::max(result, 0.0f);
+}
+
+LightBounds LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+  if (a.phi == 0.0f) {
+    return b;
+  }
+  if (b.phi == 0.0f) {
+    return a;
+  }
+  LightBounds merged = a;
+  merged.bounds.expand(b.bounds);
+  merged.phi = a.phi + b.phi;
+  merged.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+  merged.two_sided = a.two_sided || b.two_sided;
+
+  // smallest cone around both normal cones
+  float theta_a = safe_acos(a.cos_theta_o);
+  float theta_b = safe_acos(b.cos_theta_o);
+  float theta_d = angle_between(a.w, b.w);
+  if (std::min(theta_d + theta_b, glm::pi<float>()) <= theta_a) {
+    return merged;
+  }
+  if (std::min(theta_d + theta_a, glm::pi<float>()) <= theta_b) {
+    merged.w = b.w;
+    merged.cos_theta_o = b.cos_theta_o;
+    return merged;
+  }
+  float theta_o = (theta_a + theta_d + theta_b) / 2.0f;
+  glm::vec3 axis = glm::cross(a.w, b.w);
+  if (theta_o >= glm::pi<float>() || glm::dot(axis, axis) == 0.0f) {
+    merged.cos_theta_o = -1.0f;
+    return merged;
+  }
+  // rotate a.w toward b.w by the difference of the cones' half angles
+  float theta_r = theta_o - theta_a;
+  axis = glm::normalize(axis);
+  merged.w = glm::normalize(a.w * std::cos(theta_r) +
+                            glm::cross(axis, a.w) * std::sin(theta_r));
+  merged.cos_theta_o = std::cos(theta_o);
+  return merged;
+}
+
+LightBVH::LightBVH(const std::vector<LightBounds> &lights)
+    : m_leaves(lights.size(), -1) {
+  std::vector<Primitive> primitives;
+  for (size_t i = 0; i < lights.size(); i++) {
+    if (lights[i].phi > 0.0f) {
+      primitives.push_back(Primitive{lights[i], static_cast<int>(i)});
+    }
+  }
+  if (!primitives.empty()) {
+    m_nodes.reserve(2 * primitives.size() - 1);
+    build_recursive(primitives, 0, static_cast<int>(primitives.size()), -1);
+  }
+}
+
+int LightBVH::build_recursive(std::vector<Primitive> &lights, int begin,
+                              int end, int parent) {
+  int index = static_cast<int>(m_nodes.size());
+  m_nodes.emplace_back();
+  if (end - begin == 1) {
+    m_nodes[index] = Node{lights[begin].bounds, lights[begin].index, parent,
+                          true};
+    m_leaves[lights[begin].index] = index;
+    return index;
+  }
+  LightBounds bounds;
+  for (int i = begin; i < end; i++) {
+    bounds = LightBounds::merge(bounds, lights[i].bounds);
+  }
+  int mid = partition(lights, begin, end, bounds);
+  build_recursive(lights, begin, mid, index);
+  int second = build_recursive(lights, mid, end, index);
+  m_nodes[index] = Node{bounds, second, parent, false};
+  return index;
+}
+
+int LightBVH::partition(std::vector<Primitive> &lights, int begin, int end,
+                        const LightBounds &bounds) {
+  BBox centroids;
+  for (int i = begin; i < end; i++) {
+    centroids.expand(lights[i].bounds.bounds.center());
+  }
+  glm::vec3 diagonal = bounds.bounds.max() - bounds.bounds.min();
+
+  // bucketed split of lowest cost along any axis, weighing power,
+  // orientation spread and area of both sides
+  float best_cost = std::numeric_limits<float>::infinity();
+  int best_axis = -1;
+  int best_bucket = -1;
+  for (int axis = 0; axis < 3; axis++) {
+    float cmin = centroids.min()[axis];
+    float extent = centroids.max()[axis] - cmin;
+    if (!(extent > 0.0f) || !(diagonal[axis] > 0.0f)) {
+      continue;
+    }
+    LightBounds buckets[SPLIT_BUCKETS];
+    for (int i = begin; i < end; i++) {
+      int b = static_cast<int>(SPLIT_BUCKETS *
+                               (lights[i].bounds.bounds.center()[axis] - cmin) /
+                               extent);
+      b = std::clamp(b, 0, SPLIT_BUCKETS - 1);
+      buckets[b] = LightBounds::merge(buckets[b], lights[i].bounds);
+    }
+    // below[i] holds buckets up to and including i
+    LightBounds below[SPLIT_BUCKETS];
+    below[0] = buckets[0];
+    for (int i = 1; i < SPLIT_BUCKETS; i++) {
+      below[i] = LightBounds::merge(below[i - 1], buckets[i]);
+    }
+    LightBounds above;
+    for (int i = SPLIT_BUCKETS - 1; i > 0; i--) {
+      above = LightBounds::merge(above, buckets[i]);
+      if (above.phi == 0.0f || below[i - 1].phi == 0.0f) {
+        continue;
+      }
+      float cost = split_cost(below[i - 1], diagonal, axis) +
+                   split_cost(above, diagonal, axis);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bucket = i - 1;
+      }
+    }
+  }
+
+  int mid = begin + (end - begin) / 2;
+  if (best_axis >= 0) {
+    float cmin = centroids.min()[best_axis];
+    float extent = centroids.max()[best_axis] - cmin;
+    auto it = std::partition(
+        lights.begin() + begin, lights.begin() + end,
+        [&](const Primitive &light) {
+          int b = static_cast<int>(
+              SPLIT_BUCKETS * (light.bounds.bounds.center()[best_axis] - cmin) /
+              extent);
+          return std::clamp(b, 0, SPLIT_BUCKETS - 1) <= best_bucket;
+        });
+    mid = static_cast<int>(it - lights.begin());
+  }
+  // lights at one point, or an empty side, split in halves
+  if (mid == begin || mid == end) {
+    mid = begin + (end - begin) / 2;
+  }
+  return mid;
+}
+
+int LightBVH::sample(const glm::vec3 &p, const glm::vec3 &n, float u,
+                     float &pmf) const {
+  pmf = 0.0f;
+  if (m_nodes.empty()) {
+    return -1;
+  }
+  // a single light is only returned if it can reach p, as for any other
+  // leaf through its parent
+  if (m_nodes[0].leaf) {
+    if (m_nodes[0].bounds.importance(p, n) <= 0.0f) {
+      return -1;
+    }
+    pmf = 1.0f;
+    return m_nodes[0].offset;
+  }
+  const float one_minus_epsilon = std::nextafter(1.0f, 0.0f);
+  float probability = 1.0f;
+  int index = 0;
+  while (!m_nodes[index].leaf) {
+    const Node &node = m_nodes[index];
+    float first = m_nodes[index + 1].bounds.importance(p, n);
+    float second = m_nodes[node.offset].bounds.importance(p, n);
+    if (first == 0.0f && second == 0.0f) {
+      return -1;
+    }
+    // u is rescaled to choose again further down
+    float p_first = first / (first + second);
+    if (u < p_first) {
+      index = index + 1;
+      u = std::min(u / p_first, one_minus_epsilon);
+      probability *= p_first;
+    } else {
+      index = node.offset;
+      u = std::min((u - p_first) / (1.0f - p_first), one_minus_epsilon);
+      probability *= 1.0f - p_first;
+    }
+  }
+  pmf = probability;
+  return m_nodes[index].offset;
+}
+
+float LightBVH::pmf(const glm::vec3 &p, const glm::vec3 &n, int light) const {
+  int index = m_leaves[light];
+  if (index < 0) {
+    return 0.0f;
+  }
+  if (index == 0) {
+    return m_nodes[0].bounds.importance(p, n) > 0.0f ? 1.0f : 0.0f;
+  }
+  float pmf = 1.0f;
+  while (m_nodes[index].parent >= 0) {
+    int parent = m_nodes[index].parent;
+    float first = m_nodes[parent + 1].bounds.importance(p, n);
+    float second = m_nodes[m_nodes[parent].offset].bounds.importance(p, n);
+    float own = index == parent + 1 ? first : second;
+    if (own == 0.0f) {
+      return 0.0f;
+    }
+    pmf *= own / (first + second);
+    index = parent;
+  }
+  return pmf;
+}
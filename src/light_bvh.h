@@ -0,0 +1,77 @@
+#pragma once
+#include "bbox.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// What light sampling knows about a set of emitters: where they are, their
+// total power and which way they emit. Every emitting surface has its normal
+// within theta_o of w and emits within theta_e of its normal, so all light
+// leaves within theta_o + theta_e of w.
+struct LightBounds {
+  BBox bounds;
+  float phi = 0.0f;
+  glm::vec3 w = glm::vec3(0.0f, 0.0f, 1.0f);
+  float cos_theta_o = 1.0f;
+  float cos_theta_e = 1.0f;
+  // emits on both sides of the normals, w and -w
+  bool two_sided = false;
+
+  // Estimate of the light reaching a point p whose surface normal is n, an
+  // upper bound up to the distance falloff, which uses the distance to the
+  // center. Zero if none can; n may be zero to ignore the surface.
+  float importance(const glm::vec3 &p, const glm::vec3 &n) const;
+
+  static LightBounds merge(const LightBounds &a, const LightBounds &b);
+};
+
+// Binary hierarchy over lights for sampling them by their importance to a
+// shading point, after Conty Estevez and Kulla, "Importance Sampling of Many
+// Lights with Adaptive Tree Splitting". Sampling walks from the root to a
+// leaf, choosing between the children in proportion to their importance, so
+// it costs O(log n) and lights far away, facing away or behind the surface
+// are rarely picked. The pmf of a light is found by walking back up.
+class LightBVH {
+public:
+  LightBVH() = default;
+  // over the lights, which are referred to by their index; lights without
+  // power are never sampled
+  explicit LightBVH(const std::vector<LightBounds> &lights);
+
+  // Picks a light for the point p with surface normal n from u in [0, 1).
+  // Returns its index and sets pmf to its probability, or returns -1 if no
+  // light can reach p.
+  int sample(const glm::vec3 &p, const glm::vec3 &n, float u,
+             float &pmf) const;
+  // probability that sample picks the light for p and n
+  float pmf(const glm::vec3 &p, const glm::vec3 &n, int light) const;
+
+  bool empty() const { return m_nodes.empty(); }
+  int node_count() const { return static_cast<int>(m_nodes.size()); }
+
+private:
+  // nodes are stored in depth-first order, so the first child of an
+  // interior node directly follows it
+  struct Node {
+    LightBounds bounds;
+    // leaf: index of the light, interior: index of the second child
+    int offset;
+    int parent;
+    bool leaf;
+  };
+  struct Primitive {
+    LightBounds bounds;
+    int index;
+  };
+
+  int build_recursive(std::vector<Primitive> &lights, int begin, int end,
+                      int parent);
+  // index between begin and end at which the lights are split in two
+  int partition(std::vector<Primitive> &lights, int begin, int end,
+                const LightBounds &bounds);
+
+  static constexpr int SPLIT_BUCKETS = 12;
+
+  std::vector<Node> m_nodes;
+  // leaf of every light, -1 for lights without power
+  std::vector<int> m_leaves;
+};
@@ -5,4 +5,6 @@ int main() {
   // scene3();
   // scene4();
   scene5();
+  // scene7();
+  // scene8();
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include "fingerprint.h"
 #include "ray.h"
 #include "record.h"
 #include "sampler.h"
@@ -8,11 +9,25 @@
 #include <glm/geometric.hpp>
 #include <glm/gtc/constants.hpp>
 #include <iostream>
+
+// concrete type of a material, so batched shading can group hits by type and
+// visit_material can call built-in materials without virtual dispatch
+enum class MaterialType {
+  Lambertian,
+  Metal,
+  Dielectric,
+  DiffuseLight,
+  Phong,
+  Custom,
+};
+
 class Material {
 public:
   virtual ~Material() {}
+  virtual MaterialType type() const { return MaterialType::Custom; }
   virtual bool scatter(const Ray &r_in, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const = 0;
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler *sampler) const = 0;
   virtual glm::vec3 emitted(const Ray &ray, const HitRecord &rec) const {
     return glm::vec3(0.0f);
   }
@@ -25,24 +40,35 @@ public:
     return 0.0f;
   }
 
+  // scatters into a single direction, so light sampling cannot hit it and
+  // the pdf from scatter is meaningless
+  virtual bool is_specular() const { return false; }
+
+  // adds the parameters that shape the material's look, for checkpoint
+  // keys; custom materials only add their emission
+  virtual void fingerprint(Fingerprint &hash) const { hash.add(emitted()); }
+
 };
 
-class Lambertian : public Material {
+class Lambertian final : public Material {
 public:
   Lambertian(const glm::vec3 &a) : albedo(a) {}
+  virtual MaterialType type() const override { return MaterialType::Lambertian; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(albedo);
+  }
   virtual bool scatter(const Ray &ray, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const override {
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler *sampler) const override {
 
     // auto normal =
     //     glm::dot(ray.direction(), rec.normal) < 0 ? rec.normal : -rec.normal;
-    RandomSampler sampler;
-    auto r1 = sampler.get_1d();
-    auto r2 = sampler.get_1d();
-    auto sample_dir = sample_cosine_weighted_hemisphere(r1, r2);
+    auto r = sampler->get_2d();
+    auto sample_dir = sample_cosine_weighted_hemisphere(r.x, r.y);
     // create a new coordinate system based on the normal
     auto w = rec.normal;
     auto a =
-        w.x > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+        glm::abs(w.x) > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
     auto v = glm::normalize(glm::cross(w, a));
     auto u = glm::cross(w, v);
     auto dir = u * sample_dir.x + v * sample_dir.y + w * sample_dir.z;
@@ -64,7 +90,7 @@ public:
   glm::vec3 albedo;
 };
 
-class Metal : public Material {
+class Metal final : public Material {
 public:
   Metal(const glm::vec3 &a, float f = 0.0f) : albedo(a) {
     if (f < 1) {
@@ -73,27 +99,48 @@ public:
       fuzz = 1;
     }
   }
+  virtual MaterialType type() const override { return MaterialType::Metal; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(albedo);
+    hash.add(fuzz);
+  }
+  virtual bool is_specular() const override { return true; }
   virtual bool scatter(const Ray &ray, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const override {
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler *sampler) const override {
 
     glm::vec3 reflected =
         glm::reflect(glm::normalize(ray.direction()), rec.normal);
+    // rough metals blur the reflection; perfect mirrors take no samples
+    if (fuzz > 0.0f) {
+      auto r = sampler->get_2d();
+      reflected += fuzz * sample_unit_sphere(r.x, r.y);
+    }
     scattered = Ray(rec.p + rec.normal * 0.0001f, glm::normalize(reflected));
     attenuation = albedo;
     pdf = 1.0f;
-    return glm::dot(ray.direction(), rec.normal) < 0;
+    // rays blurred below the surface are absorbed
+    return glm::dot(ray.direction(), rec.normal) < 0 &&
+           glm::dot(reflected, rec.normal) > 0;
   }
 
   glm::vec3 albedo;
   float fuzz;
 };
 
-class Dielectric : public Material {
+class Dielectric final : public Material {
 
 public:
   Dielectric(float ri) : ref_idx(ri) {}
+  float refraction_index() const { return ref_idx; }
+  virtual MaterialType type() const override { return MaterialType::Dielectric; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(ref_idx);
+  }
+  virtual bool is_specular() const override { return true; }
   virtual bool scatter(const Ray &ray, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const override {
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler *sampler) const override {
     attenuation = glm::vec3(1.0, 1.0, 1.0);
     bool is_front = dot(ray.direction(), rec.normal) < 0;
     auto normal = is_front ? rec.normal : -rec.normal;
@@ -102,7 +149,7 @@ public:
     glm::vec3 refract_dir =
         glm::refract(ray.direction(), normal, etai_over_etat);
     float reflect_prob = schlick(cos_theta, etai_over_etat);
-    float r1 = rand() / (RAND_MAX + 1.0);
+    float r1 = sampler->get_1d();
     if (refract_dir == glm::vec3(0.0) || r1 < reflect_prob) {
       // only reflect
       glm::vec3 reflect_dir = glm::reflect(ray.direction(), normal);
@@ -125,11 +172,16 @@ private:
   }
 };
 
-class DiffuseLight : public Material {
+class DiffuseLight final : public Material {
 public:
   DiffuseLight(const glm::vec3 &a) : emit(a) {}
+  virtual MaterialType type() const override { return MaterialType::DiffuseLight; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(emit);
+  }
   virtual bool scatter(const Ray &ray, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const override {
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler * /*sampler*/) const override {
     return false;
   }
   virtual glm::vec3 emitted(const Ray &ray,
@@ -149,15 +201,45 @@ public:
 };
 
 
-class Phong : public Material {
+class Phong final : public Material {
 public:
   Phong(const glm::vec3 &a, const glm::vec3 &s, float p) : diffuse(a), specular(s), shininess(p) {}
+  virtual MaterialType type() const override { return MaterialType::Phong; }
+  virtual void fingerprint(Fingerprint &hash) const override {
+    hash.add(diffuse);
+    hash.add(specular);
+    hash.add(shininess);
+  }
   virtual bool scatter(const Ray &ray, const HitRecord &rec,
-                       glm::vec3 &attenuation, Ray &scattered, float& pdf) const override {
+                       glm::vec3 &attenuation, Ray &scattered, float& pdf,
+                       Sampler * /*sampler*/) const override {
     return false;
   }
 
   glm::vec3 diffuse;
   glm::vec3 specular;
   float shininess;
-};
\ No newline at end of file
+};
+
+// Calls f with material as its concrete type, given by type (which callers
+// keep next to the material rather than asking for it virtually). The
+// built-in materials are final, so calls through them bind statically;
+// custom materials are passed as Material and dispatch virtually.
+template <typename F>
+decltype(auto) visit_material(MaterialType type, const Material &material,
+                              F &&f) {
+  switch (type) {
+  case MaterialType::Lambertian:
+    return f(static_cast<const Lambertian &>(material));
+  case MaterialType::Metal:
+    return f(static_cast<const Metal &>(material));
+  case MaterialType::Dielectric:
+    return f(static_cast<const Dielectric &>(material));
+  case MaterialType::DiffuseLight:
+    return f(static_cast<const DiffuseLight &>(material));
+  case MaterialType::Phong:
+    return f(static_cast<const Phong &>(material));
+  default:
+    return f(material);
+  }
+}
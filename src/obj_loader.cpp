@@ -0,0 +1,371 @@
+#include "obj_loader.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string_view>
+#include <vector>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
+
+namespace {
+
+// files smaller than this are parsed as one chunk
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+// chunks per thread, to even out chunks that parse slower
+const int CHUNKS_PER_THREAD = 4;
+
+// The part of the file between begin and end, once parsed. Vertex indices
+// are 0 based; negative OBJ indices count back from the current vertex, so
+// until the vertices of earlier chunks are counted they are kept relative
+// to the chunk's first vertex and listed in relative.
+struct Chunk {
+  const char *begin = nullptr;
+  const char *end = nullptr;
+  std::vector<glm::vec3> vertices;
+  // three per triangle
+  std::vector<int> indices;
+  std::vector<size_t> relative;
+  // usemtl names and the triangle they apply from; triangles before the
+  // first one keep the material the previous chunk ended with
+  std::vector<std::pair<std::string, size_t>> switches;
+  std::vector<std::string> libraries;
+  size_t skipped = 0;
+};
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+const char *skip_spaces(const char *p, const char *end) {
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+  return p;
+}
+
+std::string_view next_word(const char *&p, const char *end) {
+  p = skip_spaces(p, end);
+  const char *begin = p;
+  while (p < end && !is_space(*p)) {
+    p++;
+  }
+  return std::string_view(begin, p - begin);
+}
+
+std::string_view rest_of_line(const char *p, const char *end) {
+  p = skip_spaces(p, end);
+  while (end > p && is_space(end[-1])) {
+    end--;
+  }
+  return std::string_view(p, end - p);
+}
+
+void parse_line(const char *p, const char *end, Chunk &chunk,
+                std::vector<int> &face) {
+  auto keyword = next_word(p, end);
+  if (keyword == "v") {
+    glm::vec3 v;
+    for (int k = 0; k < 3; k++) {
+      p = skip_spaces(p, end);
+      auto [next, error] = std::from_chars(p, end, v[k]);
+      if (error != std::errc()) {
+        chunk.skipped++;
+        return;
+      }
+      p = next;
+    }
+    chunk.vertices.push_back(v);
+  } else if (keyword == "f") {
+    face.clear();
+    for (auto word = next_word(p, end); !word.empty();
+         word = next_word(p, end)) {
+      // of v/vt/vn only the position is used
+      int index = 0;
+      auto [next, error] =
+          std::from_chars(word.data(), word.data() + word.size(), index);
+      if (error != std::errc() || index == 0) {
+        chunk.skipped++;
+        return;
+      }
+      face.push_back(index);
+    }
+    if (face.size() < 3) {
+      chunk.skipped++;
+      return;
+    }
+    int vertex_count = static_cast<int>(chunk.vertices.size());
+    auto add = [&](int index) {
+      if (index < 0) {
+        chunk.relative.push_back(chunk.indices.size());
+        chunk.indices.push_back(vertex_count + index);
+      } else {
+        chunk.indices.push_back(index - 1);
+      }
+    };
+    // polygons become a fan of triangles
+    for (size_t i = 1; i + 1 < face.size(); i++) {
+      add(face[0]);
+      add(face[i]);
+      add(face[i + 1]);
+    }
+  } else if (keyword == "usemtl") {
+    chunk.switches.emplace_back(std::string(rest_of_line(p, end)),
+                                chunk.indices.size() / 3);
+  } else if (keyword == "mtllib") {
+    for (auto word = next_word(p, end); !word.empty();
+         word = next_word(p, end)) {
+      chunk.libraries.emplace_back(word);
+    }
+  }
+}
+
+void parse_chunk(Chunk &chunk) {
+  std::vector<int> face;
+  const char *p = chunk.begin;
+  while (p < chunk.end) {
+    auto line_end =
+        static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+    if (!line_end) {
+      line_end = chunk.end;
+    }
+    parse_line(p, line_end, chunk, face);
+    p = line_end + 1;
+  }
+}
+
+// cuts the file into chunk_count pieces of whole lines
+std::vector<Chunk> split(const char *data, size_t size, size_t chunk_count) {
+  std::vector<Chunk> chunks;
+  const char *begin = data;
+  const char *end = data + size;
+  for (size_t i = 1; i <= chunk_count && begin < end; i++) {
+    const char *cut = data + size / chunk_count * i;
+    if (i == chunk_count) {
+      cut = end;
+    } else if (cut < begin) {
+      cut = begin;
+    }
+    auto newline = static_cast<const char *>(std::memchr(cut, '\n', end - cut));
+    cut = newline ? newline + 1 : end;
+    chunks.emplace_back();
+    chunks.back().begin = begin;
+    chunks.back().end = cut;
+    begin = cut;
+  }
+  return chunks;
+}
+
+float max_component(const glm::vec3 &v) { return std::max({v.x, v.y, v.z}); }
+
+std::shared_ptr<Material> convert_material(const tinyobj::material_t &m) {
+  glm::vec3 diffuse(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+  glm::vec3 specular(m.specular[0], m.specular[1], m.specular[2]);
+  glm::vec3 emission(m.emission[0], m.emission[1], m.emission[2]);
+  if (max_component(emission) > 0.0f) {
+    return std::make_shared<DiffuseLight>(emission);
+  }
+  // illumination models 4, 6, 7 and 9 are the refracting ones
+  if (m.dissolve < 1.0f || m.illum == 4 || m.illum == 6 || m.illum == 7 ||
+      m.illum == 9) {
+    return std::make_shared<Dielectric>(m.ior > 1.0f ? m.ior : 1.5f);
+  }
+  // 3 and 5 reflect, as does a material with only a specular color
+  if (m.illum == 3 || m.illum == 5 ||
+      (max_component(diffuse) == 0.0f && max_component(specular) > 0.0f)) {
+    // lower Phong exponents give blurrier reflections
+    float fuzz = m.roughness > 0.0f ? m.roughness
+                                    : std::sqrt(2.0f / (m.shininess + 2.0f));
+    return std::make_shared<Metal>(
+        max_component(specular) > 0.0f ? specular : diffuse, fuzz);
+  }
+  return std::make_shared<Lambertian>(diffuse);
+}
+
+void load_libraries(const std::filesystem::path &directory,
+                    const std::vector<Chunk> &chunks,
+                    std::map<std::string, int> &ids,
+                    std::vector<tinyobj::material_t> &materials,
+                    std::vector<std::string> *paths) {
+  std::set<std::string> loaded;
+  for (const auto &chunk : chunks) {
+    for (const auto &name : chunk.libraries) {
+      if (!loaded.insert(name).second) {
+        continue;
+      }
+      auto path = directory / name;
+      if (paths) {
+        paths->push_back(path.string());
+      }
+      std::ifstream stream(path);
+      if (!stream) {
+        std::cerr << "Cannot open material library " << name << std::endl;
+        continue;
+      }
+      std::string warning;
+      std::string error;
+      tinyobj::LoadMtl(&ids, &materials, &stream, &warning, &error);
+      if (!warning.empty()) {
+        std::cerr << warning;
+      }
+      if (!error.empty()) {
+        std::cerr << error;
+      }
+    }
+  }
+}
+
+} // namespace
+
+std::unique_ptr<Scene> load_obj(const std::string &path, int thread_count,
+                                std::vector<std::string> *libraries) {
+  auto start = std::chrono::steady_clock::now();
+  MappedFile file(path);
+  if (!file.data()) {
+    std::cerr << "Cannot read OBJ file " << path << std::endl;
+    return nullptr;
+  }
+
+  ThreadPool pool(thread_count);
+  size_t chunk_count =
+      std::clamp(file.size() / MIN_CHUNK_SIZE, size_t(1),
+                 size_t(pool.thread_count()) * CHUNKS_PER_THREAD);
+  auto chunks = split(file.data(), file.size(), chunk_count);
+  pool.parallel_for(static_cast<int>(chunks.size()),
+                    [&](int index, int) { parse_chunk(chunks[index]); });
+
+  std::map<std::string, int> ids;
+  std::vector<tinyobj::material_t> mtl_materials;
+  load_libraries(std::filesystem::path(path).parent_path(), chunks, ids,
+                 mtl_materials, libraries);
+  // faces without a known material get the last one
+  int default_material = static_cast<int>(mtl_materials.size());
+
+  // Lay out the shared vertex buffer and, per material, the index buffer of
+  // its mesh: every run of triangles of one chunk with one material gets
+  // its offset in the index buffer, so runs can be copied in parallel.
+  struct Run {
+    size_t chunk;
+    size_t begin;
+    size_t end;
+    int material;
+    size_t offset;
+  };
+  std::vector<Run> runs;
+  std::vector<size_t> bases(chunks.size());
+  std::vector<size_t> index_counts(default_material + 1, 0);
+  size_t vertex_count = 0;
+  size_t skipped = 0;
+  int material = default_material;
+  for (size_t c = 0; c < chunks.size(); c++) {
+    bases[c] = vertex_count;
+    vertex_count += chunks[c].vertices.size();
+    skipped += chunks[c].skipped;
+    size_t begin = 0;
+    auto add_run = [&](size_t end) {
+      if (end > begin) {
+        runs.push_back({c, begin, end, material, index_counts[material]});
+        index_counts[material] += (end - begin) * 3;
+      }
+      begin = end;
+    };
+    for (const auto &[name, triangle] : chunks[c].switches) {
+      add_run(triangle);
+      auto it = ids.find(name);
+      material = it != ids.end() ? it->second : default_material;
+    }
+    add_run(chunks[c].indices.size() / 3);
+  }
+  if (runs.empty()) {
+    std::cerr << "No faces in OBJ file " << path << std::endl;
+    return nullptr;
+  }
+  if (vertex_count > size_t(INT_MAX)) {
+    std::cerr << "Too many vertices in OBJ file " << path << std::endl;
+    return nullptr;
+  }
+  if (skipped > 0) {
+    std::cerr << "Skipped " << skipped << " malformed lines in " << path
+              << std::endl;
+  }
+
+  auto vertices = std::make_shared<std::vector<glm::vec3>>(vertex_count);
+  std::atomic<bool> out_of_range = false;
+  pool.parallel_for(static_cast<int>(chunks.size()), [&](int index, int) {
+    auto &chunk = chunks[index];
+    std::copy(chunk.vertices.begin(), chunk.vertices.end(),
+              vertices->begin() + bases[index]);
+    chunk.vertices = std::vector<glm::vec3>();
+    for (size_t i : chunk.relative) {
+      chunk.indices[i] += static_cast<int>(bases[index]);
+    }
+    for (int i : chunk.indices) {
+      if (i < 0 || static_cast<size_t>(i) >= vertex_count) {
+        out_of_range = true;
+      }
+    }
+  });
+  if (out_of_range) {
+    std::cerr << "OBJ file " << path << " uses undefined vertices"
+              << std::endl;
+    return nullptr;
+  }
+
+  std::vector<std::vector<int>> indices(index_counts.size());
+  for (size_t m = 0; m < indices.size(); m++) {
+    indices[m].resize(index_counts[m]);
+  }
+  pool.parallel_for(static_cast<int>(runs.size()), [&](int index, int) {
+    const auto &run = runs[index];
+    const auto &source = chunks[run.chunk].indices;
+    std::copy(source.begin() + run.begin * 3, source.begin() + run.end * 3,
+              indices[run.material].begin() + run.offset);
+  });
+  chunks.clear();
+
+  // each mesh builds its own BVH, so they are built in parallel
+  std::vector<int> used;
+  std::vector<std::shared_ptr<Material>> materials(index_counts.size());
+  for (int m = 0; m <= default_material; m++) {
+    if (indices[m].empty()) {
+      continue;
+    }
+    used.push_back(m);
+    materials[m] =
+        m == default_material
+            ? std::make_shared<Lambertian>(glm::vec3(0.73f, 0.73f, 0.73f))
+            : convert_material(mtl_materials[m]);
+  }
+  std::shared_ptr<const std::vector<glm::vec3>> shared = vertices;
+  std::vector<std::unique_ptr<Mesh>> meshes(used.size());
+  pool.parallel_for(static_cast<int>(used.size()), [&](int index, int) {
+    int m = used[index];
+    meshes[index] =
+        std::make_unique<Mesh>(shared, std::move(indices[m]), materials[m]);
+  });
+
+  auto scene = std::make_unique<Scene>();
+  size_t triangle_count = 0;
+  for (int m : used) {
+    triangle_count += index_counts[m] / 3;
+  }
+  for (auto &mesh : meshes) {
+    scene->add(std::move(mesh));
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << "Loaded " << path << ": " << vertex_count << " vertices, "
+            << triangle_count << " triangles, " << used.size()
+            << " meshes in " << seconds << " seconds" << std::endl;
+  return scene;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "hittable.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Loads the faces of a Wavefront OBJ file as triangles, one Mesh per
+// material, all indexing a single shared vertex buffer. The file is memory
+// mapped and cut at line boundaries into chunks that are parsed in
+// parallel. Materials come from its mtllib files, read with tinyobjloader.
+// Returns nullptr, after reporting why, if the file cannot be loaded. The
+// paths of the material libraries it refers to are appended to libraries.
+std::unique_ptr<Scene> load_obj(const std::string &path, int thread_count = 0,
+                                std::vector<std::string> *libraries = nullptr);
@@ -0,0 +1,10 @@
+#pragma once
+#include "ray.h"
+
+// A small batch of rays traced together through the acceleration structure.
+// Only the first count rays are valid.
+struct RayPacket {
+  static constexpr int SIZE = 8;
+  Ray rays[SIZE];
+  int count = 0;
+};
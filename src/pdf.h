@@ -17,13 +17,12 @@ class PDF {
 class CosinePDF : public PDF {
     public:
     virtual glm::vec3 sample(const HitRecord& rec, Sampler* sampler) const override {
-        auto r1 = sampler->get_1d();
-        auto r2 = sampler->get_1d();
-        auto sample_dir = sample_cosine_weighted_hemisphere(r1, r2);
+        auto r = sampler->get_2d();
+        auto sample_dir = sample_cosine_weighted_hemisphere(r.x, r.y);
         // create a new coordinate system based on the normal
         auto w = rec.normal;
         auto a =
-            w.x > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::abs(w.x) > 0.9f ? glm::vec3(0.0, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
         auto v = glm::normalize(glm::cross(w, a));
         auto u = glm::cross(w, v);
         auto dir = u * sample_dir.x + v * sample_dir.y + w * sample_dir.z;
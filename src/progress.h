@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+// Thread safe progress output. Workers only bump an atomic counter, and the
+// one whose update crosses the next percent prints the line.
+class ProgressReporter {
+public:
+  ProgressReporter(int total, const std::string &title)
+      : m_total(total), m_title(title) {
+    print(0);
+  }
+
+  void update(int count = 1) {
+    int done = m_done.fetch_add(count, std::memory_order_relaxed) + count;
+    int percent = m_total > 0 ? done * 100 / m_total : 100;
+    int printed = m_printed.load(std::memory_order_relaxed);
+    while (percent > printed) {
+      if (m_printed.compare_exchange_weak(printed, percent)) {
+        // a later update may have won meanwhile, print the latest
+        std::lock_guard<std::mutex> lock(m_mutex);
+        print(m_printed.load());
+        break;
+      }
+    }
+  }
+
+  void done() const { std::cout << std::endl; }
+
+private:
+  void print(int percent) const {
+    std::cout << m_title << " " << percent << "%\r" << std::flush;
+  }
+
+  int m_total;
+  std::string m_title;
+  std::atomic<int> m_done{0};
+  std::atomic<int> m_printed{0};
+  std::mutex m_mutex;
+};
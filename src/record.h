@@ -1,11 +1,17 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <limits>
-#include <optional>
-#include <string>
+// Traversal only records t, object_id, primitive_id and uv for every closer
+// hit it finds; Hittable::fill_hit computes the rest once for the closest.
 struct HitRecord {
   float t = std::numeric_limits<float>::max();
   glm::vec3 p;
   glm::vec3 normal;
-  std::optional<std::string> object_id;
+  // handles into Scene::list and Scene::materials, -1 if nothing was hit
+  int object_id = -1;
+  int material_id = -1;
+  // triangle of a mesh that was hit, -1 for other objects
+  int primitive_id = -1;
+  // barycentric weights of the triangle's second and third vertex
+  glm::vec2 uv = glm::vec2(0.0f);
 };
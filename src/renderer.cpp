@@ -1,4 +1,8 @@
 #include "renderer.h"
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <typeinfo>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -6,14 +10,529 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+Tile Renderer::tile(int index) const
+{
+  Tile tile;
+  tile.x0 = (index % tiles_x()) * TILE_SIZE;
+  tile.y0 = (index / tiles_x()) * TILE_SIZE;
+  tile.x1 = std::min(tile.x0 + TILE_SIZE, m_width);
+  tile.y1 = std::min(tile.y0 + TILE_SIZE, m_height);
+  return tile;
+}
+
+namespace
+{
+int64_t milliseconds_now()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+} // namespace
+
+bool Renderer::prepare_state(const Scene &scene, const Camera &camera,
+                             const Sampler &sampler, bool keep_stats)
+{
+  size_t pixel_count = static_cast<size_t>(m_width) * m_height;
+  int tile_count = tiles_x() * tiles_y();
+  if (!m_checkpoint_path.empty())
+  {
+    CheckpointKey key{m_width, m_height, TILE_SIZE, m_depth, 0, m_spp,
+                      fingerprint(scene, camera, sampler)};
+    if (m_adaptive)
+    {
+      key.mode = 1;
+      key.spp = m_adaptive->max_spp;
+    }
+    if (m_progressive)
+    {
+      key.mode = 2;
+      key.spp = m_progressive->pass_spp;
+    }
+    if (m_checkpoint.open(m_checkpoint_path, key, tile_count))
+    {
+      m_last_flush = milliseconds_now();
+      m_stats = {m_checkpoint.stats(), pixel_count};
+      m_tile_done = {m_checkpoint.tile_done(), static_cast<size_t>(tile_count)};
+      if (m_checkpoint.resumed())
+      {
+        std::cout << "Resuming from " << m_checkpoint_path << std::endl;
+      }
+      return m_checkpoint.resumed();
+    }
+  }
+  if (keep_stats)
+  {
+    m_stats_storage.assign(pixel_count, PixelStats());
+  }
+  else
+  {
+    m_stats_storage = std::vector<PixelStats>();
+  }
+  m_tile_done_storage.assign(tile_count, 0);
+  m_stats = m_stats_storage;
+  m_tile_done = m_tile_done_storage;
+  return false;
+}
+
+uint64_t Renderer::fingerprint(const Scene &scene, const Camera &camera,
+                               const Sampler &sampler) const
+{
+  Fingerprint hash;
+  if (m_adaptive)
+  {
+    hash.add(m_adaptive->error_threshold);
+    hash.add(m_adaptive->min_spp);
+    hash.add(m_adaptive->max_spp);
+    hash.add(m_adaptive->batch_spp);
+  }
+  // the time budget and pass limit only decide when to stop, a render
+  // resumed with what is left of them continues the same image
+  if (m_progressive)
+  {
+    hash.add(m_progressive->pass_spp);
+  }
+  hash.add(std::string_view(typeid(*m_integrator).name()));
+  hash.add(std::string_view(typeid(sampler).name()));
+  scene.fingerprint(hash);
+
+  // What the above misses, such as the camera, the sampler's seed or the
+  // parameters of custom materials and primitives, shows in the radiance of
+  // a grid of probe samples.
+  auto probe = sampler.clone();
+  for (int j = 0; j < FINGERPRINT_PROBES; j++)
+  {
+    for (int i = 0; i < FINGERPRINT_PROBES; i++)
+    {
+      glm::ivec2 pixel((2 * i + 1) * m_width / (2 * FINGERPRINT_PROBES),
+                       (2 * j + 1) * m_height / (2 * FINGERPRINT_PROBES));
+      probe->start_pixel_sample(pixel, 0);
+      glm::vec2 jitter = probe->get_2d();
+      float u = (pixel.x + jitter.x) / m_width * 2.0f - 1.0f;
+      float v = 1.0f - (pixel.y + jitter.y) / m_height * 2.0f;
+      Ray ray = camera.get_ray(u, v);
+      hash.add(ray.origin());
+      hash.add(ray.direction());
+      hash.add(m_integrator->li(ray, scene, probe.get(), m_depth));
+    }
+  }
+  return hash.value();
+}
+
+void Renderer::finish_checkpoint(bool keep_stats, bool finished)
+{
+  if (!finished)
+  {
+    m_checkpoint.sync();
+    return;
+  }
+  if (keep_stats)
+  {
+    m_stats_storage.assign(m_stats.begin(), m_stats.end());
+    m_stats = m_stats_storage;
+  }
+  else
+  {
+    m_stats = {};
+  }
+  m_tile_done = {};
+  m_checkpoint.remove();
+}
+
+void Renderer::flush_checkpoint()
+{
+  if (!m_checkpoint.is_open())
+  {
+    return;
+  }
+  // the worker that finds the interval elapsed first does the flush
+  int64_t now = milliseconds_now();
+  int64_t last = m_last_flush.load();
+  if (now - last >= m_checkpoint_interval * 1000.0 &&
+      m_last_flush.compare_exchange_strong(last, now))
+  {
+    m_checkpoint.flush();
+  }
+}
+
+std::vector<PixelStats> Renderer::gather(const Tile &tile) const
+{
+  std::vector<PixelStats> stats(tile.size());
+  for (int y = tile.y0; y < tile.y1; y++)
+  {
+    std::copy_n(&m_stats[y * m_width + tile.x0], tile.width(),
+                &stats[(y - tile.y0) * tile.width()]);
+  }
+  return stats;
+}
+
+bool Renderer::render_progressive(const Scene &scene, const Camera &camera,
+                                  const Sampler &sampler,
+                                  const WavefrontIntegrator *wavefront,
+                                  ThreadPool &pool, bool resumed)
+{
+  using clock = std::chrono::steady_clock;
+  const auto &settings = *m_progressive;
+  auto start = clock::now();
+  auto elapsed = [&] {
+    return std::chrono::duration<double>(clock::now() - start).count();
+  };
+  auto stopped = [&] {
+    return m_cancelled ||
+           (settings.time_budget > 0.0 && elapsed() >= settings.time_budget);
+  };
+
+  double last_snapshot = 0.0;
+  std::future<void> snapshot;
+  int tile_count = tiles_x() * tiles_y();
+  int pass = 0;
+  // whether a tile was skipped, leaving its pass unfinished
+  std::atomic<bool> cut_short{false};
+  if (resumed)
+  {
+    // continue with the pass the furthest behind pixel is on
+    int count = std::min_element(m_stats.begin(), m_stats.end(),
+                                 [](const auto &a, const auto &b) {
+                                   return a.count < b.count;
+                                 })->count;
+    pass = count / settings.pass_spp;
+    for (int index = 0; index < tile_count; index++)
+    {
+      Tile tile = this->tile(index);
+      resolve(tile, gather(tile).data());
+    }
+  }
+  for (; settings.max_passes == 0 || pass < settings.max_passes; pass++)
+  {
+    if (stopped())
+    {
+      break;
+    }
+    pool.parallel_for(tile_count, [&](int index, int) {
+      // a pass cut short leaves some tiles with fewer samples
+      if (stopped())
+      {
+        cut_short = true;
+        return;
+      }
+      Tile tile = this->tile(index);
+      std::vector<PixelStats> stats = gather(tile);
+      // Pixels of a tile share a count, unless the tile got ahead in a pass
+      // cut short or the process died while storing it, so bring each group
+      // of pixels with the same count up to the pass.
+      TileSamples work{tile, {}, 0, (pass + 1) * settings.pass_spp};
+      while (true)
+      {
+        work.sample_begin = std::min_element(stats.begin(), stats.end(),
+                                             [](const auto &a, const auto &b) {
+                                               return a.count < b.count;
+                                             })->count;
+        if (work.sample_begin >= work.sample_end)
+        {
+          break;
+        }
+        work.pixels.clear();
+        for (int i = 0; i < tile.size(); i++)
+        {
+          if (stats[i].count == work.sample_begin)
+          {
+            work.pixels.push_back(i);
+          }
+        }
+        sample_tile(scene, camera, sampler, wavefront, work, stats.data());
+      }
+      resolve(tile, stats.data());
+      flush_checkpoint();
+    });
+    std::cout << "Pass " << pass + 1 << ", " << elapsed() << " seconds\r"
+              << std::flush;
+
+    if (settings.snapshot_interval > 0.0 &&
+        elapsed() - last_snapshot >= settings.snapshot_interval)
+    {
+      // the image is encoded from a copy while the next pass renders, and a
+      // snapshot is skipped if the previous one is still being written
+      if (!snapshot.valid() ||
+          snapshot.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready)
+      {
+        snapshot = std::async(std::launch::async,
+                              [this, image = m_buffer, &settings] {
+                                write_png(settings.snapshot_path, m_width,
+                                          m_height, image);
+                              });
+        last_snapshot = elapsed();
+      }
+    }
+  }
+  if (snapshot.valid())
+  {
+    snapshot.wait();
+  }
+  std::cout << std::endl << "Passes: " << pass << std::endl;
+  return settings.max_passes > 0 && pass >= settings.max_passes && !cut_short;
+}
+
+std::vector<PixelStats> Renderer::render_tile(
+    const Scene &scene, const Camera &camera, const Sampler &sampler,
+    const WavefrontIntegrator *wavefront, const Tile &tile) const
+{
+  std::vector<PixelStats> stats(tile.size());
+  TileSamples work{tile, std::vector<int>(tile.size()), 0,
+                   m_adaptive ? m_adaptive->min_spp : m_spp};
+  std::iota(work.pixels.begin(), work.pixels.end(), 0);
+  while (!work.pixels.empty())
+  {
+    sample_tile(scene, camera, sampler, wavefront, work, stats.data());
+    if (!m_adaptive || work.sample_end >= m_adaptive->max_spp)
+    {
+      break;
+    }
+    // Keep sampling pixels with a neighbour that has not converged yet. A
+    // pixel alone can look converged when its first samples all missed a
+    // rare light path, which its neighbours are likely to have found.
+    std::vector<char> done(tile.size());
+    for (int i = 0; i < tile.size(); i++)
+    {
+      done[i] = converged(stats[i]);
+    }
+    std::erase_if(work.pixels, [&](int pixel) {
+      int x = pixel % tile.width();
+      int y = pixel / tile.width();
+      for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, tile.height() - 1); ny++)
+      {
+        for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, tile.width() - 1); nx++)
+        {
+          if (!done[ny * tile.width() + nx])
+          {
+            return false;
+          }
+        }
+      }
+      return true;
+    });
+    work.sample_begin = work.sample_end;
+    work.sample_end = std::min(work.sample_end + m_adaptive->batch_spp,
+                               m_adaptive->max_spp);
+  }
+  return stats;
+}
+
+void Renderer::render_views(const Scene &scene, const std::vector<View> &views)
+{
+  auto start = std::chrono::steady_clock::now();
+  RandomSampler random;
+  const Sampler &sampler = m_sampler ? *m_sampler : random;
+  auto *wavefront = dynamic_cast<WavefrontIntegrator *>(m_integrator);
+
+  struct Frame
+  {
+    std::once_flag allocated;
+    std::vector<glm::vec3> image;
+    std::atomic<int> remaining;
+  };
+  int tile_count = tiles_x() * tiles_y();
+  std::vector<Frame> frames(views.size());
+  for (auto &frame : frames)
+  {
+    frame.remaining = tile_count;
+  }
+  m_sample_count = 0;
+
+  // Tiles are numbered view by view, so each worker starts on its own run
+  // of views and frames finish one after another all through the batch.
+  ThreadPool pool(m_thread_count);
+  int total = tile_count * static_cast<int>(views.size());
+  ProgressReporter progress(total, "Rendering views");
+  pool.parallel_for(total, [&](int index, int) {
+    int view = index / tile_count;
+    Frame &frame = frames[view];
+    Tile tile = this->tile(index % tile_count);
+    auto stats = render_tile(scene, views[view].camera, sampler, wavefront, tile);
+    std::call_once(frame.allocated, [&] {
+      frame.image.assign(m_width * m_height, glm::vec3(0.0f));
+    });
+    long long samples = 0;
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+      for (int x = tile.x0; x < tile.x1; x++)
+      {
+        const auto &pixel = stats[(y - tile.y0) * tile.width() + (x - tile.x0)];
+        frame.image[y * m_width + x] = display_color(pixel);
+        samples += pixel.count;
+      }
+    }
+    m_sample_count += samples;
+    // whoever finishes the last tile saves the image, while the other
+    // workers go on with the next views
+    if (--frame.remaining == 0)
+    {
+      write_png(views[view].path, m_width, m_height, frame.image);
+      frame.image = std::vector<glm::vec3>();
+    }
+    progress.update();
+  });
+  progress.done();
+
+  if (m_adaptive)
+  {
+    std::cout << "Average spp: "
+              << double(m_sample_count) / (double(m_width) * m_height * views.size())
+              << std::endl;
+  }
+  auto seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  std::cout << "Rendered " << views.size() << " views in " << seconds
+            << " seconds" << std::endl;
+}
+
+void Renderer::sample_tile(const Scene &scene, const Camera &camera,
+                           const Sampler &sampler,
+                           const WavefrontIntegrator *wavefront,
+                           const TileSamples &work, PixelStats *stats) const
+{
+  if (wavefront)
+  {
+    wavefront->render_tile(scene, camera, work, m_width, m_height, m_depth,
+                           sampler, stats);
+  }
+  else
+  {
+    render_samples(scene, camera, sampler, work, stats);
+  }
+}
+
+void Renderer::render_samples(const Scene &scene, const Camera &camera,
+                              const Sampler &sampler, const TileSamples &work,
+                              PixelStats *stats) const
+{
+  const Tile &tile = work.tile;
+  std::unique_ptr<Sampler> samplers[RayPacket::SIZE];
+  for (auto &pixel_sampler : samplers)
+  {
+    pixel_sampler = sampler.clone();
+  }
+  for (size_t first = 0; first < work.pixels.size(); first += RayPacket::SIZE)
+  {
+    int count = std::min<int>(RayPacket::SIZE, work.pixels.size() - first);
+    glm::ivec2 pixels[RayPacket::SIZE];
+    for (int i = 0; i < count; i++)
+    {
+      int pixel = work.pixels[first + i];
+      pixels[i] = glm::ivec2(tile.x0 + pixel % tile.width(),
+                             tile.y0 + pixel / tile.width());
+    }
+    for (int s = work.sample_begin; s < work.sample_end; s++)
+    {
+      RayPacket packet;
+      packet.count = count;
+      for (int i = 0; i < count; i++)
+      {
+        samplers[i]->start_pixel_sample(pixels[i], s);
+        glm::vec2 jitter = samplers[i]->get_2d();
+        float u = (pixels[i].x + jitter.x) / m_width * 2.0f - 1.0f;
+        float v = 1.0f - (pixels[i].y + jitter.y) / m_height * 2.0f;
+        packet.rays[i] = camera.get_ray(u, v);
+      }
+      HitRecord records[RayPacket::SIZE];
+      bool hits[RayPacket::SIZE];
+      scene.hit(packet, records, hits);
+      for (int i = 0; i < count; i++)
+      {
+        stats[work.pixels[first + i]].add(
+            m_integrator->li(packet.rays[i], hits[i] ? &records[i] : nullptr,
+                             scene, samplers[i].get(), m_depth));
+      }
+    }
+  }
+}
+
+bool Renderer::converged(const PixelStats &stats) const
+{
+  float error = stats.error();
+  // confidently above white, which the output clips to
+  if (stats.mean - 3.0f * error > 1.0f)
+  {
+    return true;
+  }
+  // error of mean^(1 / gamma) to first order
+  float mean = std::max(stats.mean, MIN_LUMINANCE);
+  float slope = std::pow(mean, 1.0f / GAMMA - 1.0f) / GAMMA;
+  return error * slope <= m_adaptive->error_threshold;
+}
+
+void Renderer::resolve(const Tile &tile, const PixelStats *stats)
+{
+  std::vector<glm::vec3> colors;
+  long long samples = 0;
+  for (int y = tile.y0; y < tile.y1; y++)
+  {
+    for (int x = tile.x0; x < tile.x1; x++)
+    {
+      const auto &pixel = stats[(y - tile.y0) * tile.width() + (x - tile.x0)];
+      samples += pixel.count;
+      if (!m_stats.empty())
+      {
+        m_stats[y * m_width + x] = pixel;
+      }
+      if (m_writer)
+      {
+        colors.push_back(pixel.color());
+      }
+      else
+      {
+        m_buffer[y * m_width + x] = display_color(pixel);
+      }
+    }
+  }
+  m_sample_count += samples;
+  if (m_writer)
+  {
+    m_writer->write(tile, std::move(colors));
+  }
+}
+
 void Renderer::save(const std::string &filename) const
 {
-  std::vector<unsigned char> data(m_width * m_height * 3);
+  if (m_buffer.empty())
+  {
+    std::cerr << "No image to save, it was streamed to " << m_stream_path
+              << std::endl;
+    return;
+  }
+  write_png(filename, m_width, m_height, m_buffer);
+}
+
+void Renderer::write_png(const std::string &filename, int width, int height,
+                         const std::vector<glm::vec3> &image)
+{
+  std::vector<unsigned char> data(width * height * 3);
+  for (int i = 0; i < width * height; i++)
+  {
+    data[i * 3 + 0] = glm::clamp(image[i].x * 255.0f, 0.0f, 255.0f);
+    data[i * 3 + 1] = glm::clamp(image[i].y * 255.0f, 0.0f, 255.0f);
+    data[i * 3 + 2] = glm::clamp(image[i].z * 255.0f, 0.0f, 255.0f);
+  }
+  stbi_write_png(filename.c_str(), width, height, 3, data.data(), 0);
+}
+
+void Renderer::save_spp_map(const std::string &filename) const
+{
+  if (m_stats.empty())
+  {
+    std::cerr << "No sample counts kept for the spp map" << std::endl;
+    return;
+  }
+  int max_count = 1;
+  for (const auto &stats : m_stats)
+  {
+    max_count = std::max(max_count, stats.count);
+  }
+  std::vector<unsigned char> data(m_width * m_height);
   for (int i = 0; i < m_width * m_height; i++)
   {
-    data[i * 3 + 0] = glm::clamp(m_buffer[i].x * 255.0f, 0.0f, 255.0f);
-    data[i * 3 + 1] = glm::clamp(m_buffer[i].y * 255.0f, 0.0f, 255.0f);
-    data[i * 3 + 2] = glm::clamp(m_buffer[i].z * 255.0f, 0.0f, 255.0f);
+    data[i] = m_stats[i].count * 255 / max_count;
   }
-  stbi_write_png(filename.c_str(), m_width, m_height, 3, data.data(), 0);
+  stbi_write_png(filename.c_str(), m_width, m_height, 1, data.data(), 0);
 }
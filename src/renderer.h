@@ -1,45 +1,111 @@
 #pragma once
 #include "camera.h"
+#include "checkpoint.h"
+#include "film.h"
 #include "integrator.h"
+#include "packet.h"
+#include "progress.h"
 #include "sampler.h"
+#include "thread_pool.h"
+#include "tile_writer.h"
+#include "wavefront.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <optional>
 #include <ostream>
+#include <span>
+#include <string>
 #include <vector>
 class Renderer {
 public:
-  Renderer(int width, int height, int spp, int depth, Integrator *integrator)
+  // sampler picks the sample pattern, independent random samples if null
+  Renderer(int width, int height, int spp, int depth, Integrator *integrator,
+           const Sampler *sampler = nullptr)
       : m_width(width), m_height(height), m_spp(spp), m_depth(depth),
-        m_integrator(integrator) {
-    m_buffer.resize(m_width * m_height);
-  }
+        m_integrator(integrator), m_sampler(sampler) {}
+
+  // Adaptive sampling: every pixel takes min_spp samples, then batches of
+  // batch_spp more while the estimated error of its displayed, gamma
+  // corrected luminance is above error_threshold, up to max_spp. Replaces
+  // the fixed spp.
+  struct AdaptiveSettings {
+    float error_threshold = 0.01f;
+    int min_spp = 16;
+    int max_spp = 1024;
+    int batch_spp = 16;
+  };
+
+  // Progressive rendering: passes of pass_spp samples per pixel accumulate
+  // until max_passes, the time budget (in seconds) or cancel(), whichever
+  // comes first; 0 disables a limit. Every snapshot_interval seconds the
+  // image so far is written to snapshot_path in the background. Replaces the
+  // fixed spp.
+  struct ProgressiveSettings {
+    double time_budget = 0.0;
+    int max_passes = 0;
+    int pass_spp = 1;
+    double snapshot_interval = 0.0;
+    std::string snapshot_path;
+  };
 
   void render(const Scene &scene, const Camera &camera) {
 
     std::chrono::high_resolution_clock::time_point t1 =
         std::chrono::high_resolution_clock::now();
 
-// use OpenMP to parallelize the loop
-#pragma omp parallel for
-    for (int y = 0; y < m_height; y++) {
-
-      std::cout << "Rendering (y = " << y << "/" << m_height << ") "
-                << "\r" << std::flush;
-
-      for (int x = 0; x < m_width; x++) {
-        RandomSampler sampler;
-        glm::vec3 color(0.0f);
-        for (int s = 0; s < m_spp; s++) {
-          float u = (x + sampler.get_1d()) / m_width * 2.0f - 1.0f;
-          float v = 1.0f - (y + sampler.get_1d()) / m_height * 2.0f;
-          Ray ray = camera.get_ray(u, v);
-          color += m_integrator->li(ray, scene, &sampler, m_depth);
+    RandomSampler random;
+    const Sampler &sampler = m_sampler ? *m_sampler : random;
+    auto *wavefront = dynamic_cast<WavefrontIntegrator *>(m_integrator);
+
+    bool streaming = !m_stream_path.empty() && !m_progressive;
+    if (streaming) {
+      m_writer = std::make_unique<TileWriter>(m_stream_path, m_width, m_height);
+      m_buffer = std::vector<glm::vec3>();
+    } else {
+      m_buffer.assign(m_width * m_height, glm::vec3(0.0f));
+    }
+    m_sample_count = 0;
+    bool resumed = prepare_state(scene, camera, sampler, !streaming);
+
+    // tiles are spread over the pool by work stealing
+    ThreadPool pool(m_thread_count);
+    bool finished = true;
+    if (m_progressive) {
+      finished =
+          render_progressive(scene, camera, sampler, wavefront, pool, resumed);
+    } else {
+      int tile_count = tiles_x() * tiles_y();
+      ProgressReporter progress(tile_count, "Rendering");
+      pool.parallel_for(tile_count, [&](int index, int) {
+        Tile tile = this->tile(index);
+        if (m_tile_done[index]) {
+          resolve(tile, gather(tile).data());
+        } else {
+          resolve(tile,
+                  render_tile(scene, camera, sampler, wavefront, tile).data());
+          // after the stats, see Checkpoint::tile_done
+          std::atomic_ref<uint8_t>(m_tile_done[index])
+              .store(1, std::memory_order_release);
         }
-        color /= m_spp;
-        color = glm::pow(color, glm::vec3(1.0f / 2.2f));
-        m_buffer[y * m_width + x] = color;
-      }
+        flush_checkpoint();
+        progress.update();
+      });
+      progress.done();
     }
+    if (m_checkpoint.is_open()) {
+      finish_checkpoint(!streaming, finished);
+    }
+    if (m_writer) {
+      m_writer->finish();
+      m_writer.reset();
+    }
+    if (m_adaptive) {
+      std::cout << "Average spp: "
+                << double(m_sample_count) / (m_width * m_height) << std::endl;
+    }
+    m_cancelled = false;
 
     std::chrono::high_resolution_clock::time_point t2 =
         std::chrono::high_resolution_clock::now();
@@ -50,13 +116,133 @@ public:
     std::cout << "Render time: " << duration << " seconds" << std::endl;
   }
 
+  // One image of a batch: where to render it from and where to save it.
+  struct View {
+    Camera camera;
+    std::string path;
+  };
+
+  // Renders all views of one scene with the fixed or adaptive settings. The
+  // tiles of every view share one parallel loop, so no core waits for the
+  // end of a frame, and each image is saved as soon as its last tile is
+  // done. Only the images of views in flight are kept in memory.
+  void render_views(const Scene &scene, const std::vector<View> &views);
+
+  // gamma of the 8 bit images saved and streamed
+  static constexpr float GAMMA = 2.2f;
+
   void save(const std::string &filename) const;
+  // grayscale image of the samples taken per pixel, white at the most
+  void save_spp_map(const std::string &filename) const;
+
+  // 0 renders with one thread per hardware thread
+  void set_thread_count(int count) { m_thread_count = count; }
+  void set_adaptive(const AdaptiveSettings &settings) { m_adaptive = settings; }
+  void set_progressive(const ProgressiveSettings &settings) {
+    m_progressive = settings;
+  }
+  // Ends the progressive render in progress once the tiles in flight are
+  // done, callable from any thread. A cancel made before render() or during
+  // its setup ends the render before its first pass. The request is cleared
+  // when render() returns.
+  void cancel() { m_cancelled = true; }
+  // Streams the image to path (.ppm or .pfm) tile by tile as tiles finish,
+  // instead of keeping it in memory for save(). Progressive renders keep
+  // their image for snapshots and ignore this.
+  void set_stream_output(const std::string &path) { m_stream_path = path; }
+  // Keeps the accumulation state in a memory mapped file at path, flushed
+  // every interval seconds. A render resumes from it if it was written with
+  // the same settings, and gives the same image as an uninterrupted render.
+  void set_checkpoint(const std::string &path, double interval = 30.0) {
+    m_checkpoint_path = path;
+    m_checkpoint_interval = interval;
+  }
 
 private:
+  int tiles_x() const { return (m_width + TILE_SIZE - 1) / TILE_SIZE; }
+  int tiles_y() const { return (m_height + TILE_SIZE - 1) / TILE_SIZE; }
+  Tile tile(int index) const;
+
+  // points m_stats and m_tile_done at the checkpoint or at fresh memory,
+  // leaving m_stats empty if the stats need not be kept, and returns whether
+  // there is progress to resume
+  bool prepare_state(const Scene &scene, const Camera &camera,
+                     const Sampler &sampler, bool keep_stats);
+  // hash of what shapes the image beyond the fields of CheckpointKey, see
+  // CheckpointKey::fingerprint
+  uint64_t fingerprint(const Scene &scene, const Camera &camera,
+                       const Sampler &sampler) const;
+  void flush_checkpoint();
+  // Deletes the checkpoint of a finished render, which leaves nothing to
+  // resume, moving the stats to memory if keep_stats. A render stopped early
+  // keeps its checkpoint, synced to disk.
+  void finish_checkpoint(bool keep_stats, bool finished);
+  // copy of the tile's stats, one entry per pixel of the tile
+  std::vector<PixelStats> gather(const Tile &tile) const;
+
+  // returns whether all max_passes passes were rendered, rather than the
+  // render being stopped by its time budget or cancel()
+  bool render_progressive(const Scene &scene, const Camera &camera,
+                          const Sampler &sampler,
+                          const WavefrontIntegrator *wavefront,
+                          ThreadPool &pool, bool resumed);
+  // samples the tile with a fixed or adaptive count, returning one entry
+  // per pixel of the tile
+  std::vector<PixelStats> render_tile(const Scene &scene, const Camera &camera,
+                                      const Sampler &sampler,
+                                      const WavefrontIntegrator *wavefront,
+                                      const Tile &tile) const;
+  // adds the samples to stats, which holds one entry per pixel of the tile,
+  // with the wavefront integrator if there is one
+  void sample_tile(const Scene &scene, const Camera &camera,
+                   const Sampler &sampler,
+                   const WavefrontIntegrator *wavefront,
+                   const TileSamples &work, PixelStats *stats) const;
+  // sample_tile for other integrators, tracing camera rays of neighbouring
+  // pixels together as packets
+  void render_samples(const Scene &scene, const Camera &camera,
+                      const Sampler &sampler, const TileSamples &work,
+                      PixelStats *stats) const;
+  // stores the tile's stats and their averaged, gamma corrected colors, or
+  // hands the colors to the stream
+  void resolve(const Tile &tile, const PixelStats *stats);
+  bool converged(const PixelStats &stats) const;
+  // averaged and gamma corrected
+  static glm::vec3 display_color(const PixelStats &stats) {
+    return glm::pow(stats.color(), glm::vec3(1.0f / GAMMA));
+  }
+  static void write_png(const std::string &filename, int width, int height,
+                        const std::vector<glm::vec3> &image);
+
+  // floor for the gamma slope, which is unbounded at black
+  static constexpr float MIN_LUMINANCE = 0.01f;
+  static constexpr int TILE_SIZE = 32;
+  // samples per side of the grid of pixels traced for fingerprint()
+  static constexpr int FINGERPRINT_PROBES = 8;
+
   int m_width;
   int m_height;
   int m_spp;
   int m_depth;
   Integrator *m_integrator;
+  const Sampler *m_sampler;
+  int m_thread_count = 0;
+  std::optional<AdaptiveSettings> m_adaptive;
+  std::optional<ProgressiveSettings> m_progressive;
+  std::atomic<bool> m_cancelled{false};
+
+  std::string m_checkpoint_path;
+  double m_checkpoint_interval = 30.0;
+  Checkpoint m_checkpoint;
+  std::atomic<int64_t> m_last_flush{0};
+  // per pixel and per tile state, in the checkpoint or the vectors below
+  std::span<PixelStats> m_stats;
+  std::span<uint8_t> m_tile_done;
+  std::vector<PixelStats> m_stats_storage;
+  std::vector<uint8_t> m_tile_done_storage;
+
+  std::string m_stream_path;
+  std::unique_ptr<TileWriter> m_writer;
+  std::atomic<long long> m_sample_count{0};
   std::vector<glm::vec3> m_buffer;
 };
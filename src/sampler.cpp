@@ -0,0 +1,202 @@
+#include "sampler.h"
+#include <algorithm>
+
+namespace {
+
+constexpr float ONE_MINUS_EPSILON = 0x1.fffffep-1f;
+
+// Kensler's hashed permutation: element i of a random permutation of [0, n)
+// selected by seed, without storing the permutation.
+uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t seed) {
+  uint32_t w = n - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= seed;
+    i *= 0xe170893d;
+    i ^= seed >> 16;
+    i ^= (i & w) >> 4;
+    i ^= seed >> 8;
+    i *= 0x0929eb3f;
+    i ^= seed >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | seed >> 27;
+    i *= 0x6935fa69;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+  return (i + seed) % n;
+}
+
+const int PRIMES[] = {
+    2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+    43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+    103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+    173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239,
+    241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+constexpr uint64_t PRIME_COUNT = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+float radical_inverse(int base, uint32_t index) {
+  double inv_base = 1.0 / base;
+  double inv = inv_base;
+  double result = 0.0;
+  while (index > 0) {
+    uint32_t next = index / base;
+    result += (index - next * base) * inv;
+    inv *= inv_base;
+    index = next;
+  }
+  return std::min(static_cast<float>(result), ONE_MINUS_EPSILON);
+}
+
+uint32_t reverse_bits(uint32_t v) {
+  v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+  v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+  v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+  v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+  return (v >> 16) | (v << 16);
+}
+
+// second Sobol dimension, the first is the bit reversed index
+uint32_t sobol1(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) {
+      result ^= v;
+    }
+  }
+  return result;
+}
+
+// Owen scrambling through the Laine-Karras hash on bit reversed values
+uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+  v = reverse_bits(v);
+  v += seed;
+  v ^= v * 0x6c50b47cu;
+  v ^= v * 0xb82f1e52u;
+  v ^= v * 0xc7afe638u;
+  v ^= v * 0x8d22f6e6u;
+  return reverse_bits(v);
+}
+
+float to_float(uint32_t v) { return (v >> 8) * 0x1p-24f; }
+
+} // namespace
+
+StratifiedSampler::StratifiedSampler(int x_samples, int y_samples, bool jitter,
+                                     uint64_t seed)
+    : m_x_samples(x_samples), m_y_samples(y_samples), m_jitter(jitter),
+      m_seed(mix_bits(seed)) {
+  start_pixel_sample(glm::ivec2(0), 0);
+}
+
+std::unique_ptr<Sampler> StratifiedSampler::clone() const {
+  return std::make_unique<StratifiedSampler>(*this);
+}
+
+void StratifiedSampler::start_pixel_sample(const glm::ivec2 &pixel,
+                                           int index) {
+  m_pixel_key = hash_pixel(m_seed, pixel);
+  m_sample_key = mix_bits(m_pixel_key + static_cast<uint32_t>(index));
+  m_index = index;
+  m_dimension = 0;
+}
+
+float StratifiedSampler::get_1d() {
+  uint64_t dimension = m_dimension++;
+  uint32_t n = m_x_samples * m_y_samples;
+  uint32_t stratum = permutation_element(
+      m_index % n, n, mix_bits(m_pixel_key + dimension));
+  float delta =
+      m_jitter ? bits_to_float(mix_bits(m_sample_key + dimension)) : 0.5f;
+  return std::min((stratum + delta) / n, ONE_MINUS_EPSILON);
+}
+
+glm::vec2 StratifiedSampler::get_2d() {
+  uint64_t dimension = m_dimension;
+  m_dimension += 2;
+  uint32_t n = m_x_samples * m_y_samples;
+  uint32_t stratum = permutation_element(
+      m_index % n, n, mix_bits(m_pixel_key + dimension));
+  int x = stratum % m_x_samples;
+  int y = stratum / m_x_samples;
+  float dx = 0.5f;
+  float dy = 0.5f;
+  if (m_jitter) {
+    dx = bits_to_float(mix_bits(m_sample_key + dimension));
+    dy = bits_to_float(mix_bits(m_sample_key + dimension + 1));
+  }
+  return glm::vec2(std::min((x + dx) / m_x_samples, ONE_MINUS_EPSILON),
+                   std::min((y + dy) / m_y_samples, ONE_MINUS_EPSILON));
+}
+
+HaltonSampler::HaltonSampler(uint64_t seed) : m_seed(mix_bits(seed)) {
+  start_pixel_sample(glm::ivec2(0), 0);
+}
+
+std::unique_ptr<Sampler> HaltonSampler::clone() const {
+  return std::make_unique<HaltonSampler>(*this);
+}
+
+void HaltonSampler::start_pixel_sample(const glm::ivec2 &pixel, int index) {
+  m_pixel_key = hash_pixel(m_seed, pixel);
+  m_sample_key = mix_bits(m_pixel_key + static_cast<uint32_t>(index));
+  m_index = index;
+  m_dimension = 0;
+}
+
+float HaltonSampler::get_1d() {
+  uint64_t dimension = m_dimension++;
+  if (dimension >= PRIME_COUNT) {
+    return bits_to_float(mix_bits(m_sample_key + dimension));
+  }
+  float v = radical_inverse(PRIMES[dimension], m_index) +
+            bits_to_float(mix_bits(m_pixel_key + dimension));
+  return v >= 1.0f ? v - 1.0f : v;
+}
+
+glm::vec2 HaltonSampler::get_2d() {
+  float x = get_1d();
+  return glm::vec2(x, get_1d());
+}
+
+SobolSampler::SobolSampler(uint64_t seed) : m_seed(mix_bits(seed)) {
+  start_pixel_sample(glm::ivec2(0), 0);
+}
+
+std::unique_ptr<Sampler> SobolSampler::clone() const {
+  return std::make_unique<SobolSampler>(*this);
+}
+
+void SobolSampler::start_pixel_sample(const glm::ivec2 &pixel, int index) {
+  m_pixel_key = hash_pixel(m_seed, pixel);
+  m_index = index;
+  m_dimension = 0;
+}
+
+float SobolSampler::get_1d() {
+  uint64_t hash = mix_bits(m_pixel_key + m_dimension++);
+  uint32_t index = owen_scramble(m_index, static_cast<uint32_t>(hash));
+  return to_float(owen_scramble(reverse_bits(index),
+                                static_cast<uint32_t>(hash >> 32)));
+}
+
+glm::vec2 SobolSampler::get_2d() {
+  uint64_t hash = mix_bits(m_pixel_key + m_dimension);
+  uint64_t hash2 = mix_bits(hash);
+  m_dimension += 2;
+  uint32_t index = owen_scramble(m_index, static_cast<uint32_t>(hash));
+  return glm::vec2(to_float(owen_scramble(reverse_bits(index),
+                                          static_cast<uint32_t>(hash >> 32))),
+                   to_float(owen_scramble(sobol1(index),
+                                          static_cast<uint32_t>(hash2))));
+}
@@ -1,23 +1,128 @@
 #pragma once
+#include <cstdint>
 #include <glm/glm.hpp>
-#include <random>
+#include <memory>
+
+// splitmix64 finalizer, used to derive independent streams from counters
+inline uint64_t mix_bits(uint64_t v) {
+  v += 0x9e3779b97f4a7c15ull;
+  v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+  v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+  return v ^ (v >> 31);
+}
+
+inline uint64_t hash_pixel(uint64_t seed, const glm::ivec2 &pixel) {
+  uint64_t p = (static_cast<uint64_t>(static_cast<uint32_t>(pixel.y)) << 32) |
+               static_cast<uint32_t>(pixel.x);
+  return mix_bits(seed ^ p);
+}
+
+// top 24 bits of a hash as a float in [0, 1)
+inline float bits_to_float(uint64_t bits) { return (bits >> 40) * 0x1p-24f; }
+
+// Every get_1d call consumes one dimension and every get_2d call two, so
+// paths that make the same calls use the same dimensions.
 class Sampler {
 public:
   virtual ~Sampler() = default;
+  // a sampler of the same kind and settings, for another pixel or thread
+  virtual std::unique_ptr<Sampler> clone() const = 0;
+  // moves to sample `index` of a pixel and restarts its dimensions, so the
+  // values drawn depend only on (pixel, index, dimension)
+  virtual void start_pixel_sample(const glm::ivec2 &pixel, int index) = 0;
   virtual float get_1d() = 0;
   virtual glm::vec2 get_2d() = 0;
 };
 
+// Counter-based independent sampler. Every value is a hash of the seed,
+// pixel, sample index and dimension, so there is no generator state to seed
+// and renders are reproducible regardless of threads or scheduling.
 class RandomSampler : public Sampler {
 public:
-  RandomSampler() : m_gen(m_rd()), m_dis(0.0f, 1.0f) {}
-  virtual float get_1d() override { return m_dis(m_gen); }
+  explicit RandomSampler(uint64_t seed = 0) : m_seed(mix_bits(seed)) {
+    start_pixel_sample(glm::ivec2(0), 0);
+  }
+  virtual std::unique_ptr<Sampler> clone() const override {
+    return std::make_unique<RandomSampler>(*this);
+  }
+  virtual void start_pixel_sample(const glm::ivec2 &pixel, int index) override {
+    m_key = mix_bits(hash_pixel(m_seed, pixel) + static_cast<uint32_t>(index));
+    m_dimension = 0;
+  }
+  virtual float get_1d() override {
+    return bits_to_float(mix_bits(m_key + m_dimension++));
+  }
   virtual glm::vec2 get_2d() override {
-    return glm::vec2(m_dis(m_gen), m_dis(m_gen));
+    float x = get_1d();
+    return glm::vec2(x, get_1d());
   }
 
 private:
-  std::random_device m_rd;
-  std::mt19937 m_gen;
-  std::uniform_real_distribution<float> m_dis;
-};
\ No newline at end of file
+  uint64_t m_seed;
+  uint64_t m_key;
+  uint64_t m_dimension;
+};
+
+// Jittered stratified sampling with x_samples * y_samples strata per pixel.
+// 1D dimensions are split into as many intervals, 2D into an x by y grid,
+// and each dimension visits its strata in its own random order.
+class StratifiedSampler : public Sampler {
+public:
+  StratifiedSampler(int x_samples, int y_samples, bool jitter = true,
+                    uint64_t seed = 0);
+  virtual std::unique_ptr<Sampler> clone() const override;
+  virtual void start_pixel_sample(const glm::ivec2 &pixel, int index) override;
+  virtual float get_1d() override;
+  virtual glm::vec2 get_2d() override;
+
+private:
+  int m_x_samples;
+  int m_y_samples;
+  bool m_jitter;
+  uint64_t m_seed;
+  // per pixel, fixes the stratum order of each dimension
+  uint64_t m_pixel_key;
+  // per pixel sample, drives the jitter
+  uint64_t m_sample_key;
+  int m_index;
+  uint64_t m_dimension;
+};
+
+// Halton sequence, one prime base per dimension, decorrelated between pixels
+// by a random toroidal shift. Dimensions past the prime table are sampled
+// independently.
+class HaltonSampler : public Sampler {
+public:
+  explicit HaltonSampler(uint64_t seed = 0);
+  virtual std::unique_ptr<Sampler> clone() const override;
+  virtual void start_pixel_sample(const glm::ivec2 &pixel, int index) override;
+  virtual float get_1d() override;
+  virtual glm::vec2 get_2d() override;
+
+private:
+  uint64_t m_seed;
+  uint64_t m_pixel_key;
+  uint64_t m_sample_key;
+  int m_index;
+  uint64_t m_dimension;
+};
+
+// Owen scrambled Sobol points. Each get_2d call draws from the first two
+// Sobol dimensions and each get_1d call from the first, with the sample
+// order shuffled and the points scrambled by a hash of the pixel and
+// dimension (padded sampling, Burley 2020), so any number of dimensions
+// stay well distributed.
+class SobolSampler : public Sampler {
+public:
+  explicit SobolSampler(uint64_t seed = 0);
+  virtual std::unique_ptr<Sampler> clone() const override;
+  virtual void start_pixel_sample(const glm::ivec2 &pixel, int index) override;
+  virtual float get_1d() override;
+  virtual glm::vec2 get_2d() override;
+
+private:
+  uint64_t m_seed;
+  uint64_t m_pixel_key;
+  uint32_t m_index;
+  uint64_t m_dimension;
+};
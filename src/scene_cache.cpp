@@ -0,0 +1,411 @@
+#include "scene_cache.h"
+#include "mapped_file.h"
+#include "material.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable_v<WideBVHNode<4>> &&
+                  std::is_trivially_copyable_v<TriangleBlock>,
+              "BVH nodes and triangles are stored in the cache as raw bytes");
+
+namespace {
+const char MAGIC[8] = {'A', 'R', 'R', 'O', 'W', 'S', 'C', 'N'};
+const uint32_t VERSION = 4;
+// sections start on cache line boundaries, which keeps the nodes aligned in
+// the page aligned mapping
+const uint64_t ALIGNMENT = 64;
+
+struct Key {
+  uint32_t vertex_size;
+  uint32_t node_size;
+  BVHTree::BuildSettings bvh;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t pad;
+  Key key;
+  uint64_t source_count;
+  uint64_t sources_offset;
+  uint64_t material_count;
+  uint64_t materials_offset;
+  uint64_t buffer_count;
+  uint64_t buffers_offset;
+  uint64_t mesh_count;
+  uint64_t meshes_offset;
+};
+
+struct SourceRecord {
+  // -1 for files that did not exist
+  int64_t size;
+  int64_t modified;
+  uint64_t path_offset;
+  uint64_t path_length;
+};
+
+struct MaterialRecord {
+  int32_t type;
+  // albedo or emitted radiance
+  float color[3];
+  // Metal fuzz or Dielectric refraction index
+  float parameter;
+};
+
+struct BufferRecord {
+  uint64_t offset;
+  uint64_t count;
+};
+
+struct MeshRecord {
+  uint64_t buffer;
+  int32_t material;
+  float area;
+  uint64_t indices_offset;
+  uint64_t index_count;
+  uint64_t nodes_offset;
+  uint64_t node_count;
+  uint64_t primitives_offset;
+  uint64_t primitive_count;
+  uint64_t blocks_offset;
+  uint64_t block_count;
+  float bbox_min[3];
+  float bbox_max[3];
+};
+
+Key current_key() {
+  return Key{sizeof(glm::vec3), sizeof(WideBVHNode<4>),
+             BVHTree(SplitMethod::SAH, TRIANGLE_BLOCK_SIZE).build_settings()};
+}
+
+SourceRecord stat_source(const std::string &path) {
+  SourceRecord record{-1, 0, 0, path.size()};
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    record.size = st.st_size;
+    record.modified =
+        int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  }
+  return record;
+}
+
+bool to_record(const Material &material, MaterialRecord &record) {
+  glm::vec3 color(0.0f);
+  record.parameter = 0.0f;
+  switch (material.type()) {
+  case MaterialType::Lambertian:
+    color = static_cast<const Lambertian &>(material).albedo;
+    break;
+  case MaterialType::Metal:
+    color = static_cast<const Metal &>(material).albedo;
+    record.parameter = static_cast<const Metal &>(material).fuzz;
+    break;
+  case MaterialType::Dielectric:
+    record.parameter =
+        static_cast<const Dielectric &>(material).refraction_index();
+    break;
+  case MaterialType::DiffuseLight:
+    color = material.emitted();
+    break;
+  default:
+    return false;
+  }
+  record.type = static_cast<int32_t>(material.type());
+  for (int i = 0; i < 3; i++) {
+    record.color[i] = color[i];
+  }
+  return true;
+}
+
+std::shared_ptr<Material> from_record(const MaterialRecord &record) {
+  glm::vec3 color(record.color[0], record.color[1], record.color[2]);
+  switch (static_cast<MaterialType>(record.type)) {
+  case MaterialType::Metal:
+    return std::make_shared<Metal>(color, record.parameter);
+  case MaterialType::Dielectric:
+    return std::make_shared<Dielectric>(record.parameter);
+  case MaterialType::DiffuseLight:
+    return std::make_shared<DiffuseLight>(color);
+  default:
+    return std::make_shared<Lambertian>(color);
+  }
+}
+
+// count Ts at offset in the file, or an empty view and valid cleared if they
+// do not lie within it
+template <typename T>
+std::span<const T> section(const MappedFile &file, uint64_t offset,
+                           uint64_t count, bool &valid) {
+  if (offset % alignof(T) != 0 || offset > file.size() ||
+      count > (file.size() - offset) / sizeof(T)) {
+    valid = false;
+    return {};
+  }
+  return std::span<const T>(reinterpret_cast<const T *>(file.data() + offset),
+                            count);
+}
+
+// Whether every index of a mesh refers to an entry that exists: vertices
+// of its triangles, children and leaves of its hierarchy and triangles of
+// its blocks. Children must follow their parent, as the build stores them,
+// so a corrupt hierarchy has no cycles, and be within the depth the
+// traversal stacks hold.
+bool valid_mesh(std::span<const glm::vec3> vertices,
+                std::span<const int> indices,
+                std::span<const WideBVHNode<4>> nodes,
+                std::span<const int> primitives,
+                std::span<const TriangleBlock> blocks) {
+  if (indices.size() % 3 != 0 ||
+      blocks.size() * TRIANGLE_BLOCK_SIZE < primitives.size()) {
+    return false;
+  }
+  for (int index : indices) {
+    if (index < 0 || static_cast<size_t>(index) >= vertices.size()) {
+      return false;
+    }
+  }
+  int64_t triangle_count = indices.size() / 3;
+  auto valid_triangle = [&](int triangle) {
+    return triangle >= -1 && triangle < triangle_count;
+  };
+  for (int triangle : primitives) {
+    if (!valid_triangle(triangle)) {
+      return false;
+    }
+  }
+  for (const auto &block : blocks) {
+    for (int triangle : block.triangle) {
+      if (!valid_triangle(triangle)) {
+        return false;
+      }
+    }
+  }
+  std::vector<int> depth(nodes.size(), 0);
+  for (size_t n = 0; n < nodes.size(); n++) {
+    const auto &node = nodes[n];
+    for (int i = 0; i < 4; i++) {
+      int64_t child = node.child[i];
+      int count = node.count[i];
+      if (count == 0) {
+        if (child <= static_cast<int64_t>(n) ||
+            child >= static_cast<int64_t>(nodes.size())) {
+          return false;
+        }
+        depth[child] = std::max(depth[child], depth[n] + 1);
+        if (depth[child] >= BVHTree::MAX_DEPTH) {
+          return false;
+        }
+      } else if (count > 0 &&
+                 (child < 0 || child + count >
+                                   static_cast<int64_t>(primitives.size()))) {
+        return false;
+      } else if (count < -1) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// appends sections to a file, each at the next aligned offset
+class Writer {
+public:
+  explicit Writer(FILE *file) : m_file(file) {}
+
+  // returns the offset data was written at
+  uint64_t write(const void *data, size_t size) {
+    static const char zeros[ALIGNMENT] = {};
+    size_t padding = (ALIGNMENT - m_offset % ALIGNMENT) % ALIGNMENT;
+    m_ok = m_ok && std::fwrite(zeros, 1, padding, m_file) == padding &&
+           std::fwrite(data, 1, size, m_file) == size;
+    m_offset += padding;
+    uint64_t offset = m_offset;
+    m_offset += size;
+    return offset;
+  }
+  template <typename T> uint64_t write(std::span<const T> data) {
+    return write(data.data(), data.size_bytes());
+  }
+
+  bool ok() const { return m_ok; }
+
+private:
+  FILE *m_file;
+  uint64_t m_offset = 0;
+  bool m_ok = true;
+};
+
+} // namespace
+
+std::unique_ptr<Scene> load_scene_cache(const std::string &path) {
+  auto file = std::make_shared<MappedFile>(path);
+  if (!file->data() || file->size() < sizeof(Header)) {
+    return nullptr;
+  }
+  Header header;
+  std::memcpy(&header, file->data(), sizeof(header));
+  Key key = current_key();
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION ||
+      std::memcmp(&header.key, &key, sizeof(key)) != 0) {
+    return nullptr;
+  }
+
+  bool valid = true;
+  auto sources = section<SourceRecord>(*file, header.sources_offset,
+                                       header.source_count, valid);
+  auto material_records = section<MaterialRecord>(
+      *file, header.materials_offset, header.material_count, valid);
+  auto buffers = section<BufferRecord>(*file, header.buffers_offset,
+                                       header.buffer_count, valid);
+  auto meshes = section<MeshRecord>(*file, header.meshes_offset,
+                                    header.mesh_count, valid);
+  if (!valid) {
+    return nullptr;
+  }
+
+  for (const auto &source : sources) {
+    auto path_bytes =
+        section<char>(*file, source.path_offset, source.path_length, valid);
+    if (!valid) {
+      return nullptr;
+    }
+    auto current =
+        stat_source(std::string(path_bytes.begin(), path_bytes.end()));
+    if (current.size != source.size || current.modified != source.modified) {
+      return nullptr;
+    }
+  }
+
+  std::vector<std::shared_ptr<Material>> materials;
+  for (const auto &record : material_records) {
+    materials.push_back(from_record(record));
+  }
+  auto scene = std::make_unique<Scene>();
+  for (const auto &record : meshes) {
+    if (record.buffer >= buffers.size() || record.material < 0 ||
+        static_cast<size_t>(record.material) >= materials.size()) {
+      return nullptr;
+    }
+    const auto &buffer = buffers[record.buffer];
+    auto vertices =
+        section<glm::vec3>(*file, buffer.offset, buffer.count, valid);
+    auto indices = section<int>(*file, record.indices_offset,
+                                record.index_count, valid);
+    auto nodes = section<WideBVHNode<4>>(*file, record.nodes_offset,
+                                         record.node_count, valid);
+    auto primitives = section<int>(*file, record.primitives_offset,
+                                   record.primitive_count, valid);
+    auto blocks = section<TriangleBlock>(*file, record.blocks_offset,
+                                         record.block_count, valid);
+    if (!valid || !valid_mesh(vertices, indices, nodes, primitives, blocks)) {
+      return nullptr;
+    }
+    WideBVHTree<4> bvh;
+    bvh.attach(nodes, primitives,
+               BBox(glm::vec3(record.bbox_min[0], record.bbox_min[1],
+                              record.bbox_min[2]),
+                    glm::vec3(record.bbox_max[0], record.bbox_max[1],
+                              record.bbox_max[2])));
+    // every mesh keeps the mapping alive
+    scene->add(std::make_unique<Mesh>(file, vertices, indices, std::move(bvh),
+                                      blocks, record.area,
+                                      materials[record.material]));
+  }
+  return scene;
+}
+
+bool save_scene_cache(const std::string &path, const Scene &scene,
+                      const std::vector<std::string> &sources) {
+  std::vector<const Mesh *> meshes;
+  for (const auto &object : scene.list) {
+    auto mesh = dynamic_cast<const Mesh *>(object.get());
+    if (!mesh || mesh->material_id() < 0) {
+      return false;
+    }
+    meshes.push_back(mesh);
+  }
+  std::vector<MaterialRecord> material_records(scene.materials.size());
+  for (size_t i = 0; i < scene.materials.size(); i++) {
+    if (!to_record(*scene.materials[i], material_records[i])) {
+      return false;
+    }
+  }
+
+  // written next to the cache and renamed over it once complete, so readers
+  // never see a partial cache
+  std::string temporary = path + ".tmp";
+  FILE *file = std::fopen(temporary.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  Writer writer(file);
+  Header header{};
+  writer.write(&header, sizeof(header));
+
+  std::vector<SourceRecord> source_records;
+  for (const auto &source : sources) {
+    auto record = stat_source(source);
+    record.path_offset = writer.write(source.data(), source.size());
+    source_records.push_back(record);
+  }
+
+  // meshes cut from one model share their vertex buffer
+  std::vector<const glm::vec3 *> buffer_data;
+  std::vector<BufferRecord> buffers;
+  std::vector<MeshRecord> mesh_records;
+  for (const auto *mesh : meshes) {
+    MeshRecord record{};
+    auto vertices = mesh->vertices();
+    auto it = std::find(buffer_data.begin(), buffer_data.end(), vertices.data());
+    if (it == buffer_data.end()) {
+      buffer_data.push_back(vertices.data());
+      buffers.push_back(BufferRecord{writer.write(vertices), vertices.size()});
+      it = buffer_data.end() - 1;
+    }
+    record.buffer = it - buffer_data.begin();
+    record.material = mesh->material_id();
+    record.area = mesh->surface_area();
+    record.indices_offset = writer.write(mesh->indices());
+    record.index_count = mesh->indices().size();
+    record.nodes_offset = writer.write(mesh->bvh().node_data());
+    record.node_count = mesh->bvh().node_data().size();
+    record.primitives_offset = writer.write(mesh->bvh().index_data());
+    record.primitive_count = mesh->bvh().index_data().size();
+    record.blocks_offset = writer.write(mesh->triangle_blocks());
+    record.block_count = mesh->triangle_blocks().size();
+    auto box = mesh->bvh().bbox();
+    for (int a = 0; a < 3; a++) {
+      record.bbox_min[a] = box.min()[a];
+      record.bbox_max[a] = box.max()[a];
+    }
+    mesh_records.push_back(record);
+  }
+
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.key = current_key();
+  header.source_count = source_records.size();
+  header.sources_offset =
+      writer.write(std::span<const SourceRecord>(source_records));
+  header.material_count = material_records.size();
+  header.materials_offset =
+      writer.write(std::span<const MaterialRecord>(material_records));
+  header.buffer_count = buffers.size();
+  header.buffers_offset = writer.write(std::span<const BufferRecord>(buffers));
+  header.mesh_count = mesh_records.size();
+  header.meshes_offset =
+      writer.write(std::span<const MeshRecord>(mesh_records));
+
+  bool ok = writer.ok() && std::fseek(file, 0, SEEK_SET) == 0 &&
+            std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
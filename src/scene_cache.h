@@ -0,0 +1,24 @@
+#pragma once
+#include "hittable.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary cache of a scene of meshes: their vertex and index buffers,
+// materials and built triangle BVHs, laid out so that a read only mapping
+// of the file is used in place, without parsing or building anything. The
+// cache records the size and modification time of the files the scene was
+// made from and the BVH build settings, and is ignored once any changed.
+// The top level BVH over the meshes is not cached; Scene::build makes it.
+// Loading checks that every offset and index in the cache lies within it,
+// so a truncated or corrupt cache is rejected rather than read out of
+// bounds; damaged vertex positions or bounds only give a wrong image.
+
+// the cached scene, or nullptr if the cache is missing, stale or corrupt
+std::unique_ptr<Scene> load_scene_cache(const std::string &path);
+
+// Writes the scene, made from the files in sources. Returns false if it
+// cannot be written or holds objects other than meshes or materials other
+// than Lambertian, Metal, Dielectric and DiffuseLight.
+bool save_scene_cache(const std::string &path, const Scene &scene,
+                      const std::vector<std::string> &sources);
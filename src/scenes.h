@@ -6,6 +6,7 @@
 #include "renderer.h"
 #include "sampler.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 void scene1() {
@@ -173,11 +174,11 @@ void scene4() {
 
 /// cornell box
 void scene5() {
-  RandomSampler sampler;
+  SobolSampler sampler;
   PathIntegrator integrator;
   int width = 600;
   int height = 600;
-  Renderer renderer(width, height, 16, 10, &integrator);
+  Renderer renderer(width, height, 16, 10, &integrator, &sampler);
   Camera camera(glm::vec3(278.0f, 278.0f, -800.0f),
                 glm::vec3(278.0f, 278.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
                 40.0f, float(width) / float(height));
@@ -295,16 +296,100 @@ void scene5() {
 }
 
 void scene6() {
-    int width = 600;
-    int height = 600;
-    RandomSampler sampler;
-    PathIntegrator integrator;
-    Renderer renderer(width, height, 1, 10, &integrator);
-    auto scene = Scene::from_file("assets/cone.obj");
-    scene->build();
-    Camera camera(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f, 0.0f, -1.0f),
-                  glm::vec3(0.0f, 1.0f, 0.0f), 90.0f, 800.0f / 600.0f);
-
-    renderer.render(*scene, camera);
-    renderer.save("scene6.png");
-}
\ No newline at end of file
+  int width = 600;
+  int height = 600;
+  PathIntegrator integrator;
+  Renderer renderer(width, height, 16, 10, &integrator);
+  auto scene = Scene::from_file("assets/cone.obj");
+  if (!scene) {
+    return;
+  }
+  // light the model from above unless its materials emit
+  auto box = scene->bbox();
+  auto light = std::make_shared<DiffuseLight>(glm::vec3(8.0f, 8.0f, 8.0f));
+  scene->add(std::make_unique<Sphere>(
+      glm::vec3(box.center().x, box.max().y + 2.0f, box.center().z), 1.0f,
+      light));
+  scene->build();
+  Camera camera(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+                glm::vec3(0.0f, 1.0f, 0.0f), 90.0f,
+                float(width) / float(height));
+
+  renderer.render(*scene, camera);
+  renderer.save("scene6.png");
+}
+
+// a field of blocks, all instances of one mesh, under a light
+void add_blocks(Scene &scene) {
+  auto white = std::make_shared<Lambertian>(glm::vec3(0.73f, 0.73f, 0.73f));
+  auto red = std::make_shared<Lambertian>(glm::vec3(0.65f, 0.05f, 0.05f));
+  auto light = std::make_shared<DiffuseLight>(glm::vec3(8.0f, 8.0f, 8.0f));
+
+  // unit cube centered at the origin
+  std::vector<glm::vec3> cube_vertices = {
+      glm::vec3(-0.5f, -0.5f, -0.5f), glm::vec3(0.5f, -0.5f, -0.5f),
+      glm::vec3(0.5f, 0.5f, -0.5f),   glm::vec3(-0.5f, 0.5f, -0.5f),
+      glm::vec3(-0.5f, -0.5f, 0.5f),  glm::vec3(0.5f, -0.5f, 0.5f),
+      glm::vec3(0.5f, 0.5f, 0.5f),    glm::vec3(-0.5f, 0.5f, 0.5f),
+  };
+  std::vector<int> cube_indices = {
+      0, 2, 1, 0, 3, 2, 4, 5, 6, 4, 6, 7, 0, 1, 5, 0, 5, 4,
+      3, 6, 2, 3, 7, 6, 0, 4, 7, 0, 7, 3, 1, 2, 6, 1, 6, 5,
+  };
+  auto cube = std::make_shared<Mesh>(cube_vertices, cube_indices, white);
+
+  scene.add(std::make_unique<Sphere>(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f,
+                                     white));
+  scene.add(std::make_unique<Sphere>(glm::vec3(0.0f, 20.0f, 0.0f), 5.0f,
+                                     light));
+  for (int x = -10; x <= 10; x++) {
+    for (int z = -10; z <= 10; z++) {
+      float height = 0.5f + 0.25f * float((x * 7 + z * 13) & 7);
+      auto transform =
+          Transform::translate(glm::vec3(x, height * 0.5f, z)) *
+          Transform::rotate(0.3f * float(x + z), glm::vec3(0.0f, 1.0f, 0.0f)) *
+          Transform::scale(glm::vec3(0.6f, height, 0.6f));
+      scene.add(std::make_unique<Instance>(cube, transform,
+                                           (x + z) % 5 == 0 ? red : nullptr));
+    }
+  }
+}
+
+/// instancing: one block mesh placed many times
+void scene7() {
+  int width = 800;
+  int height = 600;
+  PathIntegrator integrator;
+  Renderer renderer(width, height, 16, 10, &integrator);
+  Camera camera(glm::vec3(0.0f, 12.0f, 24.0f), glm::vec3(0.0f, 0.0f, 0.0f),
+                glm::vec3(0.0f, 1.0f, 0.0f), 45.0f,
+                float(width) / float(height));
+  Scene scene;
+  add_blocks(scene);
+  scene.build();
+  renderer.render(scene, camera);
+  renderer.save("scene7.png");
+}
+
+/// turntable: the blocks from all around, with one scene build
+void scene8() {
+  int width = 400;
+  int height = 300;
+  int frames = 36;
+  PathIntegrator integrator;
+  Renderer renderer(width, height, 16, 10, &integrator);
+  Camera camera(glm::vec3(0.0f, 12.0f, 24.0f), glm::vec3(0.0f, 0.0f, 0.0f),
+                glm::vec3(0.0f, 1.0f, 0.0f), 45.0f,
+                float(width) / float(height));
+  Scene scene;
+  add_blocks(scene);
+  scene.build();
+  std::vector<Renderer::View> views;
+  for (int i = 0; i < frames; i++) {
+    auto turn = Transform::rotate(2.0f * glm::pi<float>() * i / frames,
+                                  glm::vec3(0.0f, 1.0f, 0.0f));
+    views.push_back(
+        {camera.transformed(turn), "scene8_" + std::to_string(i) + ".png"});
+  }
+  renderer.render_views(scene, views);
+}
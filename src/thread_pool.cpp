@@ -0,0 +1,100 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int thread_count) {
+  if (thread_count <= 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < thread_count; i++) {
+    m_queues.push_back(std::make_unique<Queue>());
+  }
+  for (int i = 1; i < thread_count; i++) {
+    m_threads.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_start.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::parallel_for(int count,
+                              const std::function<void(int, int)> &task) {
+  int workers = thread_count();
+  for (int w = 0; w < workers; w++) {
+    auto &queue = *m_queues[w];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    for (int i = count * w / workers; i < count * (w + 1) / workers; i++) {
+      queue.indices.push_back(i);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_running = workers - 1;
+    m_generation++;
+  }
+  m_start.notify_all();
+  run(0);
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_running == 0; });
+  m_task = nullptr;
+}
+
+void ThreadPool::worker_loop(int worker) {
+  uint64_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_start.wait(lock,
+                   [&] { return m_stop || m_generation != generation; });
+      if (m_stop) {
+        return;
+      }
+      generation = m_generation;
+    }
+    run(worker);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running--;
+    }
+    m_done.notify_one();
+  }
+}
+
+void ThreadPool::run(int worker) {
+  int index;
+  while (pop(worker, index) || steal(worker, index)) {
+    (*m_task)(index, worker);
+  }
+}
+
+bool ThreadPool::pop(int worker, int &index) {
+  auto &queue = *m_queues[worker];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.indices.empty()) {
+    return false;
+  }
+  index = queue.indices.front();
+  queue.indices.pop_front();
+  return true;
+}
+
+bool ThreadPool::steal(int worker, int &index) {
+  int workers = thread_count();
+  for (int i = 1; i < workers; i++) {
+    auto &queue = *m_queues[(worker + i) % workers];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.indices.empty()) {
+      index = queue.indices.back();
+      queue.indices.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops by work stealing. Each
+// worker starts on its own contiguous share of the iterations and, once
+// that is done, steals from the far end of the other workers' shares, so
+// uneven iterations (tiles with glass or lights) do not leave cores idle.
+class ThreadPool {
+public:
+  // 0 uses one thread per hardware thread
+  explicit ThreadPool(int thread_count = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int thread_count() const { return static_cast<int>(m_queues.size()); }
+
+  // runs task(index, worker) for every index in [0, count) and returns once
+  // all are done; the calling thread works as worker 0
+  void parallel_for(int count, const std::function<void(int, int)> &task);
+
+private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<int> indices;
+  };
+
+  void worker_loop(int worker);
+  void run(int worker);
+  bool pop(int worker, int &index);
+  bool steal(int worker, int &index);
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_start;
+  std::condition_variable m_done;
+  const std::function<void(int, int)> *m_task = nullptr;
+  uint64_t m_generation = 0;
+  int m_running = 0;
+  bool m_stop = false;
+};
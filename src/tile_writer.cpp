@@ -0,0 +1,120 @@
+#include "tile_writer.h"
+#include "renderer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+TileWriter::TileWriter(const std::string &path, int width, int height,
+                       size_t max_pending)
+    : m_width(width), m_height(height), m_max_pending(max_pending) {
+  std::string header;
+  if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0) {
+    m_format = Format::PFM;
+    m_pixel_size = 3 * sizeof(float);
+    // a negative scale marks little endian data
+    header = "PF\n" + std::to_string(width) + " " + std::to_string(height) +
+             "\n-1.0\n";
+  } else {
+    m_format = Format::PPM;
+    m_pixel_size = 3;
+    header = "P6\n" + std::to_string(width) + " " + std::to_string(height) +
+             "\n255\n";
+  }
+  m_header_size = header.size();
+
+  m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0) {
+    std::cerr << "Cannot open " << path << std::endl;
+    return;
+  }
+  size_t size = m_header_size + m_pixel_size * width * height;
+  if (ftruncate(m_fd, size) != 0 ||
+      pwrite(m_fd, header.data(), header.size(), 0) !=
+          static_cast<ssize_t>(header.size())) {
+    std::cerr << "Cannot write " << path << std::endl;
+    ::close(m_fd);
+    m_fd = -1;
+    return;
+  }
+  m_thread = std::thread(&TileWriter::run, this);
+}
+
+TileWriter::~TileWriter() { finish(); }
+
+void TileWriter::write(const Tile &tile, std::vector<glm::vec3> colors) {
+  if (!is_open()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_not_full.wait(lock, [this] { return m_queue.size() < m_max_pending; });
+  m_queue.push_back(Pending{tile, std::move(colors)});
+  m_not_empty.notify_one();
+}
+
+void TileWriter::finish() {
+  if (!is_open()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_finished = true;
+  }
+  m_not_empty.notify_one();
+  m_thread.join();
+  ::close(m_fd);
+  m_fd = -1;
+}
+
+void TileWriter::run() {
+  std::vector<char> bytes;
+  while (true) {
+    Pending pending;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_not_empty.wait(lock, [this] { return m_finished || !m_queue.empty(); });
+      if (m_queue.empty()) {
+        return;
+      }
+      pending = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    m_not_full.notify_one();
+
+    encode(pending, bytes);
+    const Tile &tile = pending.tile;
+    size_t row_bytes = m_pixel_size * tile.width();
+    for (int y = tile.y0; y < tile.y1; y++) {
+      // PFM stores rows bottom to top
+      int row = m_format == Format::PFM ? m_height - 1 - y : y;
+      off_t offset = m_header_size +
+                     m_pixel_size * (static_cast<size_t>(row) * m_width +
+                                     tile.x0);
+      if (pwrite(m_fd, &bytes[(y - tile.y0) * row_bytes], row_bytes,
+                 offset) != static_cast<ssize_t>(row_bytes)) {
+        std::cerr << "Short write of tile at " << tile.x0 << ", " << tile.y0
+                  << std::endl;
+      }
+    }
+  }
+}
+
+void TileWriter::encode(const Pending &pending,
+                        std::vector<char> &bytes) const {
+  bytes.resize(pending.colors.size() * m_pixel_size);
+  for (size_t i = 0; i < pending.colors.size(); i++) {
+    const glm::vec3 &c = pending.colors[i];
+    if (m_format == Format::PFM) {
+      float rgb[3] = {c.x, c.y, c.z};
+      std::memcpy(&bytes[i * m_pixel_size], rgb, sizeof(rgb));
+    } else {
+      for (int k = 0; k < 3; k++) {
+        float v = std::pow(std::max(c[k], 0.0f), 1.0f / Renderer::GAMMA);
+        bytes[i * 3 + k] = static_cast<char>(
+            static_cast<unsigned char>(std::clamp(v * 255.0f, 0.0f, 255.0f)));
+      }
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "film.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes an image tile by tile, in any order, as tiles finish. Encoding and
+// file writes run on a background thread and every row of a tile goes
+// straight to its place in the file, so memory is bounded by the tiles
+// queued, not the image size. The format follows the extension: binary PPM
+// (8 bit, gamma corrected) or PFM (linear float).
+class TileWriter {
+public:
+  // max_pending queued tiles make write() wait for the encoder
+  TileWriter(const std::string &path, int width, int height,
+             size_t max_pending = 64);
+  ~TileWriter();
+  TileWriter(const TileWriter &) = delete;
+  TileWriter &operator=(const TileWriter &) = delete;
+
+  bool is_open() const { return m_fd >= 0; }
+
+  // queues the linear colors of the tile, one per pixel
+  void write(const Tile &tile, std::vector<glm::vec3> colors);
+  // writes out the queued tiles and closes the file
+  void finish();
+
+private:
+  enum class Format { PPM, PFM };
+
+  struct Pending {
+    Tile tile;
+    std::vector<glm::vec3> colors;
+  };
+
+  void run();
+  void encode(const Pending &pending, std::vector<char> &bytes) const;
+
+  int m_fd = -1;
+  Format m_format = Format::PPM;
+  int m_width;
+  int m_height;
+  size_t m_header_size = 0;
+  size_t m_pixel_size = 0;
+  size_t m_max_pending;
+
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+  std::deque<Pending> m_queue;
+  bool m_finished = false;
+  std::thread m_thread;
+};
@@ -3,34 +3,53 @@
 #include <glm/ext.hpp>
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/glm.hpp>
-using namespace glm;
 class Transform {
 public:
-  static Transform lookAt(const vec3 &eye, const vec3 &center, const vec3 &up) {
+  static Transform lookAt(const glm::vec3 &eye, const glm::vec3 &center,
+                          const glm::vec3 &up) {
     auto inv = glm::lookAt(eye, center, up);
-    auto m = inverse(inv);
+    auto m = glm::inverse(inv);
     return Transform(m, inv);
   }
 
-  Transform(const mat4 &matrix)
-      : m_matrix(matrix), m_inverse(inverse(matrix)) {}
-  Transform(const mat4 &matrix, const mat4 &inverse)
+  Transform(const glm::mat4 &matrix)
+      : m_matrix(matrix), m_inverse(glm::inverse(matrix)) {}
+  Transform(const glm::mat4 &matrix, const glm::mat4 &inverse)
       : m_matrix(matrix), m_inverse(inverse) {}
-  vec3 vector_to_world(const vec3 &v) const {
-    return vec3(m_matrix * vec4(v, 0.0f));
+  glm::vec3 vector_to_world(const glm::vec3 &v) const {
+    return glm::vec3(m_matrix * glm::vec4(v, 0.0f));
   }
-  vec3 point_to_world(const vec3 &p) const {
-    return vec3(m_matrix * vec4(p, 1.0f));
+  glm::vec3 point_to_world(const glm::vec3 &p) const {
+    return glm::vec3(m_matrix * glm::vec4(p, 1.0f));
   }
 
-  vec3 vector_to_local(const vec3 &v) const {
-    return vec3(m_inverse * vec4(v, 0.0f));
+  glm::vec3 vector_to_local(const glm::vec3 &v) const {
+    return glm::vec3(m_inverse * glm::vec4(v, 0.0f));
   }
-  vec3 point_to_local(const vec3 &p) const {
-    return vec3(m_inverse * vec4(p, 1.0f));
+  glm::vec3 point_to_local(const glm::vec3 &p) const {
+    return glm::vec3(m_inverse * glm::vec4(p, 1.0f));
+  }
+
+  // normals transform by the inverse transpose, the result is not normalized
+  glm::vec3 normal_to_world(const glm::vec3 &n) const {
+    return glm::vec3(glm::vec4(n, 0.0f) * m_inverse);
+  }
+
+  static Transform translate(const glm::vec3 &t) {
+    return Transform(glm::translate(glm::mat4(1.0f), t));
+  }
+  static Transform scale(const glm::vec3 &s) {
+    return Transform(glm::scale(glm::mat4(1.0f), s));
+  }
+  static Transform rotate(float radians, const glm::vec3 &axis) {
+    return Transform(glm::rotate(glm::mat4(1.0f), radians, axis));
+  }
+
+  Transform operator*(const Transform &t) const {
+    return Transform(m_matrix * t.m_matrix, t.m_inverse * m_inverse);
   }
 
 private:
-  mat4 m_matrix;
-  mat4 m_inverse;
+  glm::mat4 m_matrix;
+  glm::mat4 m_inverse;
 };
@@ -0,0 +1,31 @@
+#include "triangle.h"
+#include <algorithm>
+
+std::vector<TriangleBlock>
+build_triangle_blocks(std::span<const glm::vec3> vertices,
+                      std::span<const int> indices,
+                      std::span<const int> triangles) {
+  TriangleBlock empty{};
+  std::fill(std::begin(empty.triangle), std::end(empty.triangle), -1);
+  std::vector<TriangleBlock> blocks(
+      (triangles.size() + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE,
+      empty);
+  for (size_t i = 0; i < triangles.size(); i++) {
+    if (triangles[i] < 0) {
+      continue;
+    }
+    auto &block = blocks[i / TRIANGLE_BLOCK_SIZE];
+    int lane = i % TRIANGLE_BLOCK_SIZE;
+    block.triangle[lane] = triangles[i];
+    size_t first = static_cast<size_t>(triangles[i]) * 3;
+    const auto &v0 = vertices[indices[first]];
+    const auto &v1 = vertices[indices[first + 1]];
+    const auto &v2 = vertices[indices[first + 2]];
+    for (int a = 0; a < 3; a++) {
+      block.v0[a][lane] = v0[a];
+      block.v1[a][lane] = v1[a];
+      block.v2[a][lane] = v2[a];
+    }
+  }
+  return blocks;
+}
@@ -0,0 +1,192 @@
+#pragma once
+#include "ray.h"
+#include <bit>
+#include <glm/glm.hpp>
+#include <limits>
+#include <span>
+#include <vector>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Triangles tested together, one SSE lane each. Mesh hierarchies cap their
+// leaves at one block and price them by block (see BVHTree's
+// leaf_block_size); a 200k triangle soup fills about 80% of the lanes.
+constexpr int TRIANGLE_BLOCK_SIZE = 4;
+
+// Vertices of a block of triangles in structure of arrays layout. The
+// vertices are stored rather than v0 and two edges: the test below is only
+// watertight when neighbours see bit identical shared vertices, which
+// v0 + edge does not reproduce.
+struct alignas(16) TriangleBlock {
+  float v0[3][TRIANGLE_BLOCK_SIZE];
+  float v1[3][TRIANGLE_BLOCK_SIZE];
+  float v2[3][TRIANGLE_BLOCK_SIZE];
+  // index of every lane's triangle in its mesh, -1 for unused lanes
+  int triangle[TRIANGLE_BLOCK_SIZE];
+};
+
+// Ray set up for the watertight test of Woop, Benthin and Wald, "Watertight
+// Ray/Triangle Intersection": vertices are moved to the ray origin and
+// sheared so that the ray runs along +z through (0, 0), which reduces the
+// test to 2D edge functions. Computed once per ray and shared by all the
+// triangles it is tested against.
+struct TriangleRay {
+  explicit TriangleRay(const Ray &ray) : o(ray.o), t_min(ray.t_min) {
+    glm::vec3 d = glm::abs(ray.d);
+    kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    sx = -ray.d[kx] / ray.d[kz];
+    sy = -ray.d[ky] / ray.d[kz];
+    sz = 1.0f / ray.d[kz];
+  }
+
+  glm::vec3 o;
+  float t_min;
+  int kx, ky, kz;
+  float sx, sy, sz;
+};
+
+// Distance to the triangle if it is in (ray.t_min, t_max), and the
+// barycentric weights of v1 and v2 at the hit.
+inline bool intersect_triangle(const TriangleRay &ray, const glm::vec3 &v0,
+                               const glm::vec3 &v1, const glm::vec3 &v2,
+                               float t_max, float &t, glm::vec2 &uv) {
+  glm::vec3 a = v0 - ray.o;
+  glm::vec3 b = v1 - ray.o;
+  glm::vec3 c = v2 - ray.o;
+  float ax = a[ray.kx] + ray.sx * a[ray.kz];
+  float ay = a[ray.ky] + ray.sy * a[ray.kz];
+  float bx = b[ray.kx] + ray.sx * b[ray.kz];
+  float by = b[ray.ky] + ray.sy * b[ray.kz];
+  float cx = c[ray.kx] + ray.sx * c[ray.kz];
+  float cy = c[ray.ky] + ray.sy * c[ray.kz];
+  // Edge functions, the ray passes inside when they agree in sign. A shared
+  // edge must give exactly opposite values on its two triangles, so these
+  // must not be fused into FMAs (built with -ffp-contract=off).
+  float u = cx * by - cy * bx;
+  float v = ax * cy - ay * cx;
+  float w = bx * ay - by * ax;
+  if ((u < 0.0f || v < 0.0f || w < 0.0f) &&
+      (u > 0.0f || v > 0.0f || w > 0.0f)) {
+    return false;
+  }
+  float det = u + v + w;
+  if (det == 0.0f) {
+    return false;
+  }
+  float distance =
+      (u * a[ray.kz] + v * b[ray.kz] + w * c[ray.kz]) * ray.sz / det;
+  if (distance > ray.t_min && distance < t_max) {
+    t = distance;
+    uv = glm::vec2(v, w) / det;
+    return true;
+  }
+  return false;
+}
+
+// Tests the lanes of a block set in mask. Returns the lane of the nearest
+// hit in (ray.t_min, t_max) and sets t and uv as intersect_triangle, or -1.
+inline int intersect_triangles_scalar(const TriangleBlock &block,
+                                      const TriangleRay &ray, unsigned mask,
+                                      float t_max, float &t, glm::vec2 &uv) {
+  int nearest = -1;
+  for (; mask; mask &= mask - 1) {
+    int i = std::countr_zero(mask);
+    glm::vec3 v0(block.v0[0][i], block.v0[1][i], block.v0[2][i]);
+    glm::vec3 v1(block.v1[0][i], block.v1[1][i], block.v1[2][i]);
+    glm::vec3 v2(block.v2[0][i], block.v2[1][i], block.v2[2][i]);
+    if (intersect_triangle(ray, v0, v1, v2, t_max, t, uv)) {
+      t_max = t;
+      nearest = i;
+    }
+  }
+  return nearest;
+}
+
+// intersect_triangles_scalar with SSE
+inline int intersect_triangles(const TriangleBlock &block,
+                               const TriangleRay &ray, unsigned mask,
+                               float t_max, float &t, glm::vec2 &uv) {
+#if defined(__SSE__)
+  // the same steps as intersect_triangle, on all lanes at once
+  __m128 ox = _mm_set1_ps(ray.o[ray.kx]);
+  __m128 oy = _mm_set1_ps(ray.o[ray.ky]);
+  __m128 oz = _mm_set1_ps(ray.o[ray.kz]);
+  __m128 sx = _mm_set1_ps(ray.sx);
+  __m128 sy = _mm_set1_ps(ray.sy);
+  __m128 az = _mm_sub_ps(_mm_load_ps(block.v0[ray.kz]), oz);
+  __m128 bz = _mm_sub_ps(_mm_load_ps(block.v1[ray.kz]), oz);
+  __m128 cz = _mm_sub_ps(_mm_load_ps(block.v2[ray.kz]), oz);
+  __m128 ax = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v0[ray.kx]), ox),
+                         _mm_mul_ps(sx, az));
+  __m128 ay = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v0[ray.ky]), oy),
+                         _mm_mul_ps(sy, az));
+  __m128 bx = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v1[ray.kx]), ox),
+                         _mm_mul_ps(sx, bz));
+  __m128 by = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v1[ray.ky]), oy),
+                         _mm_mul_ps(sy, bz));
+  __m128 cx = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v2[ray.kx]), ox),
+                         _mm_mul_ps(sx, cz));
+  __m128 cy = _mm_add_ps(_mm_sub_ps(_mm_load_ps(block.v2[ray.ky]), oy),
+                         _mm_mul_ps(sy, cz));
+  __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+  __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+  __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+  __m128 zero = _mm_setzero_ps();
+  __m128 negative =
+      _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+                _mm_cmplt_ps(w, zero));
+  __m128 positive =
+      _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+                _mm_cmpgt_ps(w, zero));
+  __m128 outside = _mm_and_ps(negative, positive);
+  if ((~_mm_movemask_ps(outside) & mask) == 0) {
+    return -1;
+  }
+  __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+  __m128 distance = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)),
+                 _mm_mul_ps(w, cz)),
+      _mm_set1_ps(ray.sz));
+  distance = _mm_div_ps(distance, det);
+  __m128 hit = _mm_andnot_ps(
+      outside,
+      _mm_and_ps(_mm_cmpgt_ps(distance, _mm_set1_ps(ray.t_min)),
+                 _mm_cmplt_ps(distance, _mm_set1_ps(t_max))));
+  unsigned hits = _mm_movemask_ps(hit) & mask;
+  if (hits == 0) {
+    return -1;
+  }
+  alignas(16) float distances[TRIANGLE_BLOCK_SIZE];
+  _mm_store_ps(distances, distance);
+  // few lanes hit, so the nearest is found without a horizontal minimum
+  int nearest = std::countr_zero(hits);
+  for (hits &= hits - 1; hits; hits &= hits - 1) {
+    int i = std::countr_zero(hits);
+    if (distances[i] < distances[nearest]) {
+      nearest = i;
+    }
+  }
+  t = distances[nearest];
+  // barycentrics only for the lane that is kept
+  alignas(16) float weights[3][TRIANGLE_BLOCK_SIZE];
+  _mm_store_ps(weights[0], v);
+  _mm_store_ps(weights[1], w);
+  _mm_store_ps(weights[2], det);
+  uv = glm::vec2(weights[0][nearest], weights[1][nearest]) /
+       weights[2][nearest];
+  return nearest;
+#else
+  return intersect_triangles_scalar(block, ray, mask, t_max, t, uv);
+#endif
+}
+
+// Blocks for the triangles of a mesh in the given order, block i holding
+// triangles TRIANGLE_BLOCK_SIZE * i onwards. Lanes of triangles given as -1
+// and past the end are degenerate and never hit.
+std::vector<TriangleBlock>
+build_triangle_blocks(std::span<const glm::vec3> vertices,
+                      std::span<const int> indices,
+                      std::span<const int> triangles);
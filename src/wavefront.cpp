@@ -0,0 +1,222 @@
+#include "wavefront.h"
+#include "packet.h"
+#include <array>
+#include <type_traits>
+
+void WavefrontIntegrator::render_tile(const Scene &scene, const Camera &camera,
+                                      const TileSamples &work, int width,
+                                      int height, int depth,
+                                      const Sampler &sampler,
+                                      PixelStats *stats) const {
+  Samplers samplers(work.pixels.size());
+  for (auto &pixel_sampler : samplers) {
+    pixel_sampler = sampler.clone();
+  }
+  Queues queues;
+  for (int s = work.sample_begin; s < work.sample_end; s++) {
+    generate(camera, work, width, height, s, samplers, queues.paths);
+    queues.radiance.assign(work.pixels.size(), glm::vec3(0.0f));
+    for (int bounce = 0; bounce < depth && queues.paths.size() > 0;
+         bounce++) {
+      extend(scene, queues);
+      shade(scene, queues, samplers, bounce, depth);
+      trace_shadows(scene, queues);
+      std::swap(queues.paths, queues.next);
+    }
+    for (size_t i = 0; i < work.pixels.size(); i++) {
+      stats[work.pixels[i]].add(queues.radiance[i]);
+    }
+  }
+}
+
+void WavefrontIntegrator::generate(const Camera &camera,
+                                   const TileSamples &work, int width,
+                                   int height, int index, Samplers &samplers,
+                                   PathQueue &paths) const {
+  paths.clear();
+  const Tile &tile = work.tile;
+  for (size_t i = 0; i < work.pixels.size(); i++) {
+    int x = tile.x0 + work.pixels[i] % tile.width();
+    int y = tile.y0 + work.pixels[i] / tile.width();
+    auto &sampler = *samplers[i];
+    sampler.start_pixel_sample(glm::ivec2(x, y), index);
+    glm::vec2 jitter = sampler.get_2d();
+    float u = (x + jitter.x) / width * 2.0f - 1.0f;
+    float v = 1.0f - (y + jitter.y) / height * 2.0f;
+    Ray ray = camera.get_ray(u, v);
+    paths.push(ray.origin(), ray.direction(), glm::vec3(1.0f), 0.0f,
+               glm::vec3(0.0f), i);
+  }
+}
+
+void WavefrontIntegrator::extend(const Scene &scene, Queues &queues) const {
+  const auto &paths = queues.paths;
+  queues.records.assign(paths.size(), HitRecord());
+  queues.hits.assign(paths.size(), false);
+  for (size_t i = 0; i < paths.size(); i += RayPacket::SIZE) {
+    RayPacket packet;
+    packet.count = std::min<int>(RayPacket::SIZE, paths.size() - i);
+    for (int k = 0; k < packet.count; k++) {
+      packet.rays[k] = Ray(paths.origin[i + k], paths.direction[i + k]);
+    }
+    bool hits[RayPacket::SIZE];
+    scene.hit(packet, &queues.records[i], hits);
+    for (int k = 0; k < packet.count; k++) {
+      queues.hits[i + k] = hits[k];
+    }
+  }
+}
+
+void WavefrontIntegrator::shade(const Scene &scene, Queues &queues,
+                                Samplers &samplers, int bounce,
+                                int depth) const {
+  queues.next.clear();
+  queues.shadows.clear();
+  // paths that escaped the scene carry no radiance and end here
+  constexpr size_t type_count = static_cast<size_t>(MaterialType::Custom) + 1;
+  std::array<std::vector<int>, type_count> batches;
+  for (size_t i = 0; i < queues.paths.size(); i++) {
+    if (queues.hits[i]) {
+      auto type = scene.material_type(queues.records[i].material_id);
+      batches[static_cast<size_t>(type)].push_back(i);
+    }
+  }
+  for (size_t t = 0; t < type_count; t++) {
+    const auto &batch = batches[t];
+    if (batch.empty()) {
+      continue;
+    }
+    switch (static_cast<MaterialType>(t)) {
+    case MaterialType::Lambertian:
+      shade_batch<Lambertian>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    case MaterialType::Metal:
+      shade_batch<Metal>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    case MaterialType::Dielectric:
+      shade_batch<Dielectric>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    case MaterialType::DiffuseLight:
+      shade_batch<DiffuseLight>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    case MaterialType::Phong:
+      shade_batch<Phong>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    case MaterialType::Custom:
+      shade_batch<Material>(scene, queues, batch, samplers, bounce, depth);
+      break;
+    }
+  }
+}
+
+// Shades hits on materials of one concrete type T. Calls are qualified with
+// T so they bind statically, only custom materials (T = Material) go through
+// the virtual functions.
+template <typename T>
+void WavefrontIntegrator::shade_batch(const Scene &scene, Queues &queues,
+                                      const std::vector<int> &batch,
+                                      Samplers &samplers, int bounce,
+                                      int depth) const {
+  const auto &paths = queues.paths;
+  auto &next = queues.next;
+  auto &shadows = queues.shadows;
+  for (int i : batch) {
+    const HitRecord &record = queues.records[i];
+    const T *material = static_cast<const T *>(scene.material(record.material_id));
+    Ray ray(paths.origin[i], paths.direction[i]);
+    int pixel = paths.pixel[i];
+    Sampler *sampler = samplers[pixel].get();
+    glm::vec3 attenuation;
+    Ray scattered;
+    float pdf;
+    bool scatters;
+    bool specular;
+    glm::vec3 emitted;
+    if constexpr (std::is_same_v<T, Material>) {
+      emitted = material->emitted(ray, record);
+      scatters =
+          material->scatter(ray, record, attenuation, scattered, pdf, sampler);
+      specular = material->is_specular();
+    } else {
+      emitted = material->T::emitted(ray, record);
+      scatters = material->T::scatter(ray, record, attenuation, scattered, pdf,
+                                      sampler);
+      specular = material->T::is_specular();
+    }
+    if (emitted != glm::vec3(0.0f)) {
+      queues.radiance[pixel] +=
+          paths.throughput[i] * emitted *
+          emission_weight(ray, record, scene, paths.pdf[i], paths.normal[i]);
+    }
+    if (!scatters) {
+      continue;
+    }
+    // as in PathIntegrator::li
+    bool last = bounce + 1 == depth;
+    glm::vec3 throughput = paths.throughput[i] * attenuation;
+    if (specular) {
+      if (!last && survives_roulette(throughput, bounce, sampler)) {
+        next.push(scattered.origin(), scattered.direction(), throughput, 0.0f,
+                  record.normal, pixel);
+      }
+      continue;
+    }
+
+    LightSample light;
+    if (!last &&
+        sample_light(record, scattered.origin(), scene, sampler, light)) {
+      float scattering;
+      if constexpr (std::is_same_v<T, Material>) {
+        scattering = material->scattering_pdf(ray, record, light.ray);
+      } else {
+        scattering = material->T::scattering_pdf(ray, record, light.ray);
+      }
+      if (scattering > 0.0f) {
+        shadows.ray.push_back(light.ray);
+        shadows.distance.push_back(light.distance);
+        shadows.contribution.push_back(
+            paths.throughput[i] * attenuation * scattering * light.radiance *
+            power_heuristic(light.pdf, scattering) / light.pdf);
+        shadows.pixel.push_back(pixel);
+      }
+    }
+
+    if (pdf <= 0.0f) {
+      continue;
+    }
+    float scattering;
+    if constexpr (std::is_same_v<T, Material>) {
+      scattering = material->scattering_pdf(ray, record, scattered);
+    } else {
+      scattering = material->T::scattering_pdf(ray, record, scattered);
+    }
+    throughput = paths.throughput[i] * scattering * attenuation / pdf;
+    if (!last && survives_roulette(throughput, bounce, sampler)) {
+      next.push(scattered.origin(), scattered.direction(), throughput, pdf,
+                record.normal, pixel);
+    }
+  }
+}
+
+void WavefrontIntegrator::trace_shadows(const Scene &scene,
+                                        Queues &queues) const {
+  // shadow rays of neighbouring pixels go toward the same lights, so they
+  // are traced in packets
+  const auto &shadows = queues.shadows;
+  for (size_t i = 0; i < shadows.size(); i += RayPacket::SIZE) {
+    RayPacket packet;
+    packet.count = std::min<int>(RayPacket::SIZE, shadows.size() - i);
+    for (int k = 0; k < packet.count; k++) {
+      packet.rays[k] = shadows.ray[i + k];
+      packet.rays[k].t_max =
+          std::min(packet.rays[k].t_max, shadows.distance[i + k]);
+    }
+    bool blocked[RayPacket::SIZE];
+    scene.occluded(packet, blocked);
+    for (int k = 0; k < packet.count; k++) {
+      if (!blocked[k]) {
+        queues.radiance[shadows.pixel[i + k]] += shadows.contribution[i + k];
+      }
+    }
+  }
+}
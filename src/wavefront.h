@@ -0,0 +1,98 @@
+#pragma once
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include <vector>
+
+// Paths in flight in structure of arrays layout, one entry per path.
+struct PathQueue {
+  std::vector<glm::vec3> origin;
+  std::vector<glm::vec3> direction;
+  std::vector<glm::vec3> throughput;
+  // pdf of the BSDF sample the ray was made by, 0 for camera rays and
+  // specular bounces, and the normal where it was taken, see
+  // PathIntegrator::emission_weight
+  std::vector<float> pdf;
+  std::vector<glm::vec3> normal;
+  // position of the path's pixel in TileSamples::pixels
+  std::vector<int> pixel;
+
+  size_t size() const { return pixel.size(); }
+  void clear() {
+    origin.clear();
+    direction.clear();
+    throughput.clear();
+    pdf.clear();
+    normal.clear();
+    pixel.clear();
+  }
+  void push(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &beta,
+            float bsdf_pdf, const glm::vec3 &n, int p) {
+    origin.push_back(o);
+    direction.push_back(d);
+    throughput.push_back(beta);
+    pdf.push_back(bsdf_pdf);
+    normal.push_back(n);
+    pixel.push_back(p);
+  }
+};
+
+// Shadow rays toward the lights sampled by the shading stage, whose
+// contribution reaches their pixel unless something is in the way.
+struct ShadowQueue {
+  std::vector<Ray> ray;
+  std::vector<float> distance;
+  std::vector<glm::vec3> contribution;
+  std::vector<int> pixel;
+
+  size_t size() const { return pixel.size(); }
+  void clear() {
+    ray.clear();
+    distance.clear();
+    contribution.clear();
+    pixel.clear();
+  }
+};
+
+// Wavefront formulation of PathIntegrator. All paths of a tile advance
+// together, one bounce at a time, through separate stages that each run as a
+// tight loop over a queue: camera ray generation, extension to the closest
+// hit in ray packets, shading grouped by material type, which samples
+// lights and continuations, and occlusion tests of the shadow rays. It
+// evaluates the same estimator as PathIntegrator::li with the same per pixel
+// sample sequence.
+class WavefrontIntegrator : public PathIntegrator {
+public:
+  // adds the samples to stats, which holds one entry per pixel of the tile,
+  // drawing them from clones of sampler
+  void render_tile(const Scene &scene, const Camera &camera,
+                   const TileSamples &work, int width, int height, int depth,
+                   const Sampler &sampler, PixelStats *stats) const;
+
+private:
+  // one per pixel sampled
+  using Samplers = std::vector<std::unique_ptr<Sampler>>;
+
+  struct Queues {
+    PathQueue paths;
+    PathQueue next;
+    std::vector<HitRecord> records;
+    std::vector<bool> hits;
+    ShadowQueue shadows;
+    // radiance of the current sample of every pixel
+    std::vector<glm::vec3> radiance;
+  };
+
+  void generate(const Camera &camera, const TileSamples &work, int width,
+                int height, int index, Samplers &samplers,
+                PathQueue &paths) const;
+  void extend(const Scene &scene, Queues &queues) const;
+  // bounce counts the hits so far from 0, of at most depth
+  void shade(const Scene &scene, Queues &queues, Samplers &samplers,
+             int bounce, int depth) const;
+  template <typename T>
+  void shade_batch(const Scene &scene, Queues &queues,
+                   const std::vector<int> &batch, Samplers &samplers,
+                   int bounce, int depth) const;
+  void trace_shadows(const Scene &scene, Queues &queues) const;
+};
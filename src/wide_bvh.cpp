@@ -0,0 +1,38 @@
+#include "wide_bvh.h"
+#include "hittable.h"
+
+template <int N>
+bool WideBVH<N>::hit(const Ray &ray, HitRecord &record) const {
+  return tree.hit(ray, record,
+                  [this](int index, const Ray &r, HitRecord &rec) {
+                    return intersect_closest(*list[index], r, rec);
+                  });
+}
+
+template <int N>
+void WideBVH<N>::hit(const RayPacket &packet, HitRecord *records,
+                     bool *hits) const {
+  tree.hit(packet, records, hits,
+           [this](int index, const Ray &r, HitRecord &rec) {
+             return intersect_closest(*list[index], r, rec);
+           });
+}
+
+template <int N>
+bool WideBVH<N>::occluded(const Ray &r, float t_max) const {
+  Ray ray = r;
+  ray.t_max = std::min(ray.t_max, t_max);
+  return tree.occluded(ray, [this](int index, const Ray &ray) {
+    return occluded_primitive(*list[index], ray, ray.t_max);
+  });
+}
+
+template <int N>
+void WideBVH<N>::occluded(const RayPacket &packet, bool *blocked) const {
+  tree.occluded(packet, blocked, [this](int index, const Ray &ray) {
+    return occluded_primitive(*list[index], ray, ray.t_max);
+  });
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
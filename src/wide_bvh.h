@@ -0,0 +1,773 @@
+#pragma once
+#include "accel.h"
+#include "packet.h"
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <span>
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// Node with up to N children whose bounds are stored in structure of arrays
+// layout, one SIMD lane per child, so all children are tested in one pass.
+template <int N> struct alignas(32) WideBVHNode {
+  float min[3][N];
+  float max[3][N];
+  // interior child: node index, leaf child: first entry in primitive_indices
+  int child[N];
+  // primitives in a leaf child, 0 for interior children and -1 for empty
+  // slots, whose bounds are inverted so they never pass the slab test
+  int count[N];
+};
+
+// Slab test of one ray against all children of a node. Returns a bit mask of
+// the children hit and writes their entry distances to t_near.
+template <int N>
+inline int intersect_children_scalar(const WideBVHNode<N> &node,
+                                     const glm::vec3 &o,
+                                     const glm::vec3 &inv_dir,
+                                     const int dir_is_neg[3], float t_min,
+                                     float t_max, float *t_near) {
+  int mask = 0;
+  for (int i = 0; i < N; i++) {
+    float t0 = t_min;
+    float t1 = t_max;
+    for (int a = 0; a < 3; a++) {
+      float near = ((dir_is_neg[a] ? node.max[a][i] : node.min[a][i]) - o[a]) *
+                   inv_dir[a];
+      float far = ((dir_is_neg[a] ? node.min[a][i] : node.max[a][i]) - o[a]) *
+                  inv_dir[a];
+      t0 = near > t0 ? near : t0;
+      t1 = far < t1 ? far : t1;
+    }
+    t_near[i] = t0;
+    mask |= (t0 <= t1) << i;
+  }
+  return mask;
+}
+
+inline int intersect_children(const WideBVHNode<4> &node, const glm::vec3 &o,
+                              const glm::vec3 &inv_dir,
+                              const int dir_is_neg[3], float t_min,
+                              float t_max, float *t_near) {
+#if defined(__SSE__)
+  __m128 t0 = _mm_set1_ps(t_min);
+  __m128 t1 = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    __m128 origin = _mm_set1_ps(o[a]);
+    __m128 inv = _mm_set1_ps(inv_dir[a]);
+    __m128 near = _mm_load_ps(dir_is_neg[a] ? node.max[a] : node.min[a]);
+    __m128 far = _mm_load_ps(dir_is_neg[a] ? node.min[a] : node.max[a]);
+    near = _mm_mul_ps(_mm_sub_ps(near, origin), inv);
+    far = _mm_mul_ps(_mm_sub_ps(far, origin), inv);
+    // operands are ordered so a NaN from 0 * inf keeps the running interval
+    t0 = _mm_max_ps(near, t0);
+    t1 = _mm_min_ps(far, t1);
+  }
+  _mm_storeu_ps(t_near, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  return intersect_children_scalar(node, o, inv_dir, dir_is_neg, t_min, t_max,
+                                   t_near);
+#endif
+}
+
+inline int intersect_children(const WideBVHNode<8> &node, const glm::vec3 &o,
+                              const glm::vec3 &inv_dir,
+                              const int dir_is_neg[3], float t_min,
+                              float t_max, float *t_near) {
+#if defined(__AVX__)
+  __m256 t0 = _mm256_set1_ps(t_min);
+  __m256 t1 = _mm256_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    __m256 origin = _mm256_set1_ps(o[a]);
+    __m256 inv = _mm256_set1_ps(inv_dir[a]);
+    __m256 near = _mm256_load_ps(dir_is_neg[a] ? node.max[a] : node.min[a]);
+    __m256 far = _mm256_load_ps(dir_is_neg[a] ? node.min[a] : node.max[a]);
+    near = _mm256_mul_ps(_mm256_sub_ps(near, origin), inv);
+    far = _mm256_mul_ps(_mm256_sub_ps(far, origin), inv);
+    t0 = _mm256_max_ps(near, t0);
+    t1 = _mm256_min_ps(far, t1);
+  }
+  _mm256_storeu_ps(t_near, t0);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#else
+  return intersect_children_scalar(node, o, inv_dir, dir_is_neg, t_min, t_max,
+                                   t_near);
+#endif
+}
+
+// N-wide hierarchy collapsed from a binary BVHTree, with the same
+// intersection callback interface.
+template <int N> class WideBVHTree {
+  static_assert(N == 4 || N == 8, "only 4 and 8 wide nodes are supported");
+
+public:
+  WideBVHTree() = default;
+  // the views would still point into the source's storage
+  WideBVHTree(const WideBVHTree &) = delete;
+  WideBVHTree &operator=(const WideBVHTree &) = delete;
+  WideBVHTree(WideBVHTree &&) = default;
+  WideBVHTree &operator=(WideBVHTree &&) = default;
+
+  // leaf_alignment > 1 starts every leaf at a multiple of it in
+  // index_data(), padding with -1, so leaves can map onto SIMD blocks
+  void build(const BVHTree &tree, int leaf_alignment = 1);
+
+  // uses nodes and indices built earlier, e.g. mapped from a scene cache,
+  // in place; they must outlive the tree
+  void attach(std::span<const WideBVHNode<N>> nodes,
+              std::span<const int> primitive_indices, const BBox &bbox) {
+    m_node_storage.clear();
+    m_index_storage.clear();
+    this->nodes = nodes;
+    this->primitive_indices = primitive_indices;
+    m_bbox = bbox;
+  }
+
+  template <typename Intersect>
+  bool hit(const Ray &r, HitRecord &record, Intersect &&intersect) const;
+  // Like hit, but tests whole leaves: intersect_leaf(first, count, ray,
+  // record) is given the leaf's range in index_data() and returns whether
+  // it found a hit closer than ray.t_max, updating record.t.
+  template <typename IntersectLeaf>
+  bool hit_leaves(const Ray &r, HitRecord &record,
+                  IntersectLeaf &&intersect_leaf) const;
+
+  // Closest hits for a packet. Coherent rays share node tests and fall back
+  // to single ray traversal once few of them remain in a subtree.
+  template <typename Intersect>
+  void hit(const RayPacket &packet, HitRecord *records, bool *hits,
+           Intersect &&intersect) const;
+
+  // see BVHTree::occluded
+  template <typename Occluded>
+  bool occluded(const Ray &ray, Occluded &&occluded) const;
+  // occluded_leaf(first, count, ray) tests a whole leaf
+  template <typename OccludedLeaf>
+  bool occluded_leaves(const Ray &ray, OccludedLeaf &&occluded_leaf) const;
+
+  // Whether each ray of a packet is occluded within its own t_max, the same
+  // as occluded one ray at a time. Shares node tests like the packet hit.
+  template <typename Occluded>
+  void occluded(const RayPacket &packet, bool *blocked,
+                Occluded &&occluded) const;
+
+  BBox bbox() const { return m_bbox; }
+
+  size_t node_count() const { return nodes.size(); }
+
+  std::span<const WideBVHNode<N>> node_data() const { return nodes; }
+  std::span<const int> index_data() const { return primitive_indices; }
+
+private:
+  // single ray traversal of the subtree rooted at a node (count == 0) or a
+  // leaf (count > 0), ray.t_max must already be clamped to record.t
+  template <typename IntersectLeaf>
+  bool traverse(int child, int count, Ray &ray, HitRecord &record,
+                IntersectLeaf &intersect_leaf) const;
+  // single ray any hit search of the subtree rooted at a node (count == 0)
+  // or a leaf (count > 0)
+  template <typename OccludedLeaf>
+  bool occluded_subtree(int child, int count, const Ray &ray,
+                        OccludedLeaf &occluded_leaf) const;
+  // leaf test calling intersect for every primitive in the leaf
+  template <typename Intersect>
+  auto primitive_leaves(Intersect &intersect) const {
+    return [this, &intersect](int first, int count, const Ray &r,
+                              HitRecord &record) {
+      Ray ray = r;
+      bool hit = false;
+      for (int i = 0; i < count; i++) {
+        if (intersect(primitive_indices[first + i], ray, record)) {
+          ray.t_max = record.t;
+          hit = true;
+        }
+      }
+      return hit;
+    };
+  }
+  // leaf test calling occluded for every primitive in the leaf
+  template <typename Occluded>
+  auto primitive_occluders(Occluded &occluded) const {
+    return [this, &occluded](int first, int count, const Ray &ray) {
+      for (int i = 0; i < count; i++) {
+        if (occluded(primitive_indices[first + i], ray)) {
+          return true;
+        }
+      }
+      return false;
+    };
+  }
+
+  // subtrees reached by at most this many rays of a packet are traversed one
+  // ray at a time
+  static constexpr int PACKET_FALLBACK_RAYS = 2;
+
+  // creates a node whose children are the given binary nodes
+  int collapse(const BVHTree &tree, const std::vector<int> &children);
+
+  // views of the storage below, or of attached memory
+  std::span<const WideBVHNode<N>> nodes;
+  std::span<const int> primitive_indices;
+  std::vector<WideBVHNode<N>> m_node_storage;
+  std::vector<int> m_index_storage;
+  BBox m_bbox;
+};
+
+template <int N>
+void WideBVHTree<N>::build(const BVHTree &tree, int leaf_alignment) {
+  m_node_storage.clear();
+  m_index_storage = tree.primitive_indices;
+  m_bbox = tree.bbox();
+  if (!tree.nodes.empty()) {
+    const auto &root = tree.nodes[0];
+    if (root.primitive_count > 0) {
+      collapse(tree, {0});
+    } else {
+      collapse(tree, {1, root.second_child_offset});
+    }
+  }
+  if (leaf_alignment > 1) {
+    m_index_storage.clear();
+    for (auto &node : m_node_storage) {
+      for (int i = 0; i < N; i++) {
+        if (node.count[i] <= 0) {
+          continue;
+        }
+        size_t first = (m_index_storage.size() + leaf_alignment - 1) /
+                       leaf_alignment * leaf_alignment;
+        m_index_storage.resize(first, -1);
+        auto leaf = tree.primitive_indices.begin() + node.child[i];
+        m_index_storage.insert(m_index_storage.end(), leaf,
+                               leaf + node.count[i]);
+        node.child[i] = first;
+      }
+    }
+  }
+  nodes = m_node_storage;
+  primitive_indices = m_index_storage;
+}
+
+template <int N>
+int WideBVHTree<N>::collapse(const BVHTree &tree,
+                             const std::vector<int> &binary_children) {
+  // open the interior child with the largest surface area until all N slots
+  // are used, which keeps the children of a node similar in size
+  std::vector<int> children = binary_children;
+  while (static_cast<int>(children.size()) < N) {
+    int best = -1;
+    float best_area = -1.0f;
+    for (size_t i = 0; i < children.size(); i++) {
+      const auto &node = tree.nodes[children[i]];
+      if (node.primitive_count == 0 && node.bbox.surface_area() > best_area) {
+        best = i;
+        best_area = node.bbox.surface_area();
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    int node = children[best];
+    children[best] = node + 1;
+    children.push_back(tree.nodes[node].second_child_offset);
+  }
+
+  int node_index = m_node_storage.size();
+  m_node_storage.emplace_back();
+  for (int i = 0; i < N; i++) {
+    auto &node = m_node_storage[node_index];
+    if (i >= static_cast<int>(children.size())) {
+      for (int a = 0; a < 3; a++) {
+        node.min[a][i] = std::numeric_limits<float>::infinity();
+        node.max[a][i] = -std::numeric_limits<float>::infinity();
+      }
+      node.child[i] = 0;
+      node.count[i] = -1;
+      continue;
+    }
+    const auto &child = tree.nodes[children[i]];
+    for (int a = 0; a < 3; a++) {
+      node.min[a][i] = child.bbox.min()[a];
+      node.max[a][i] = child.bbox.max()[a];
+    }
+    if (child.primitive_count > 0) {
+      node.child[i] = child.primitives_offset;
+      node.count[i] = child.primitive_count;
+    } else {
+      int index = collapse(tree, {children[i] + 1, child.second_child_offset});
+      // nodes may have been reallocated by the recursion
+      m_node_storage[node_index].child[i] = index;
+      m_node_storage[node_index].count[i] = 0;
+    }
+  }
+  return node_index;
+}
+
+template <int N>
+template <typename Intersect>
+bool WideBVHTree<N>::hit(const Ray &r, HitRecord &record,
+                         Intersect &&intersect) const {
+  return hit_leaves(r, record, primitive_leaves(intersect));
+}
+
+template <int N>
+template <typename IntersectLeaf>
+bool WideBVHTree<N>::hit_leaves(const Ray &r, HitRecord &record,
+                                IntersectLeaf &&intersect_leaf) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  Ray ray = r;
+  ray.t_max = std::min(record.t, ray.t_max);
+  return traverse(0, 0, ray, record, intersect_leaf);
+}
+
+template <int N>
+template <typename IntersectLeaf>
+bool WideBVHTree<N>::traverse(int child, int count, Ray &ray,
+                              HitRecord &record,
+                              IntersectLeaf &intersect_leaf) const {
+  glm::vec3 inv_dir = 1.0f / ray.direction();
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+  // leaves are pushed like nodes, with their primitive count
+  struct Entry {
+    int child;
+    int count;
+    float t_near;
+  };
+  Entry stack[BVHTree::MAX_DEPTH * N];
+  int stack_size = 0;
+  stack[stack_size++] = Entry{child, count, ray.t_min};
+
+  bool hit = false;
+  while (stack_size > 0) {
+    Entry entry = stack[--stack_size];
+    if (entry.t_near > ray.t_max) {
+      continue;
+    }
+    if (entry.count > 0) {
+      if (intersect_leaf(entry.child, entry.count, ray, record)) {
+        ray.t_max = record.t;
+        hit = true;
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    float t_near[N];
+    int mask = intersect_children(node, ray.o, inv_dir, dir_is_neg, ray.t_min,
+                                  ray.t_max, t_near);
+    // push the children far to near so the nearest is popped first
+    int first = stack_size;
+    while (mask) {
+      int i = std::countr_zero(static_cast<unsigned>(mask));
+      mask &= mask - 1;
+      // a ray with NaN components passes the slab test of empty slots too
+      if (node.count[i] < 0) {
+        continue;
+      }
+      int j = stack_size++;
+      while (j > first && stack[j - 1].t_near < t_near[i]) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = Entry{node.child[i], node.count[i], t_near[i]};
+    }
+  }
+  return hit;
+}
+
+template <int N>
+template <typename Occluded>
+bool WideBVHTree<N>::occluded(const Ray &ray, Occluded &&occluded) const {
+  return occluded_leaves(ray, primitive_occluders(occluded));
+}
+
+template <int N>
+template <typename OccludedLeaf>
+bool WideBVHTree<N>::occluded_leaves(const Ray &ray,
+                                     OccludedLeaf &&occluded_leaf) const {
+  if (nodes.empty()) {
+    return false;
+  }
+  return occluded_subtree(0, 0, ray, occluded_leaf);
+}
+
+template <int N>
+template <typename OccludedLeaf>
+bool WideBVHTree<N>::occluded_subtree(int child, int count, const Ray &ray,
+                                      OccludedLeaf &occluded_leaf) const {
+  if (count > 0) {
+    return occluded_leaf(child, count, ray);
+  }
+  glm::vec3 inv_dir = 1.0f / ray.direction();
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+  // any hit ends the search, so nodes are not sorted by distance and leaves
+  // are tested as soon as they are found
+  int stack[BVHTree::MAX_DEPTH * N];
+  int stack_size = 0;
+  stack[stack_size++] = child;
+  while (stack_size > 0) {
+    const auto &node = nodes[stack[--stack_size]];
+    float t_near[N];
+    int mask = intersect_children(node, ray.o, inv_dir, dir_is_neg, ray.t_min,
+                                  ray.t_max, t_near);
+    while (mask) {
+      int i = std::countr_zero(static_cast<unsigned>(mask));
+      mask &= mask - 1;
+      if (node.count[i] == 0) {
+        stack[stack_size++] = node.child[i];
+      } else if (node.count[i] > 0 &&
+                 occluded_leaf(node.child[i], node.count[i], ray)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Rays of a packet in structure of arrays layout, one SIMD lane per ray.
+struct alignas(32) PacketRays {
+  float o[3][RayPacket::SIZE];
+  float inv_dir[3][RayPacket::SIZE];
+  float t_min[RayPacket::SIZE];
+  float t_max[RayPacket::SIZE];
+};
+
+// Slab test of every ray of a packet against one box, given its near and far
+// planes for the packet's shared direction signs. Returns the mask of rays
+// hitting it and the smallest entry distance among them.
+inline unsigned intersect_rays(const PacketRays &rays, const float near[3],
+                               const float far[3], float &t_near_min) {
+#if defined(__AVX__)
+  static_assert(RayPacket::SIZE == 8, "one AVX lane per ray");
+  __m256 t0 = _mm256_load_ps(rays.t_min);
+  __m256 t1 = _mm256_load_ps(rays.t_max);
+  for (int a = 0; a < 3; a++) {
+    __m256 o = _mm256_load_ps(rays.o[a]);
+    __m256 inv = _mm256_load_ps(rays.inv_dir[a]);
+    __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(near[a]), o), inv);
+    __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(far[a]), o), inv);
+    t0 = _mm256_max_ps(n, t0);
+    t1 = _mm256_min_ps(f, t1);
+  }
+  __m256 hit = _mm256_cmp_ps(t0, t1, _CMP_LE_OQ);
+  unsigned mask = _mm256_movemask_ps(hit);
+  // lanes that missed get +inf before the horizontal minimum
+  __m256 t = _mm256_blendv_ps(
+      _mm256_set1_ps(std::numeric_limits<float>::infinity()), t0, hit);
+  __m128 m = _mm_min_ps(_mm256_castps256_ps128(t), _mm256_extractf128_ps(t, 1));
+  m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+  t_near_min = _mm_cvtss_f32(m);
+  return mask;
+#else
+  unsigned mask = 0;
+  t_near_min = std::numeric_limits<float>::infinity();
+  for (int k = 0; k < RayPacket::SIZE; k++) {
+    float t0 = rays.t_min[k];
+    float t1 = rays.t_max[k];
+    for (int a = 0; a < 3; a++) {
+      float n = (near[a] - rays.o[a][k]) * rays.inv_dir[a][k];
+      float f = (far[a] - rays.o[a][k]) * rays.inv_dir[a][k];
+      t0 = n > t0 ? n : t0;
+      t1 = f < t1 ? f : t1;
+    }
+    if (t0 <= t1) {
+      mask |= 1u << k;
+      t_near_min = t0 < t_near_min ? t0 : t_near_min;
+    }
+  }
+  return mask;
+#endif
+}
+
+// The rays of a packet set up for the shared node tests of the packet
+// traversals, which need every ray to have the same direction signs.
+struct PacketTraversal {
+  PacketTraversal(const Ray *rays, int count);
+
+  // Near and far planes of every child of node for the shared direction
+  // signs, and the mask of children the interval bounds below cannot rule
+  // out. Empty slots are never candidates.
+  template <int N>
+  unsigned candidates(const WideBVHNode<N> &node, float near[3][N],
+                      float far[3][N]) const;
+
+  // unused lanes get an empty interval so they never hit anything
+  PacketRays soa;
+  int dir_is_neg[3];
+  // whether all rays share direction signs, incoherent packets are traced
+  // one ray at a time
+  bool coherent = true;
+  // Interval arithmetic over the packet's origins and inverse directions
+  // bounds the entry and exit distances of all its rays at once. A child
+  // the interval misses is missed by every ray, so it is rejected without
+  // the per ray test. With the signs fixed the bounds reduce to one product
+  // per plane: the extreme origin on each side picks which end of the
+  // inverse direction interval gives the extreme distance.
+  float o_near[3], o_far[3], inv_lo[3], inv_hi[3];
+  // infinite inverse directions would turn the bounds into NaN
+  bool use_interval = true;
+  // smallest t_min of the packet
+  float t_min;
+};
+
+inline PacketTraversal::PacketTraversal(const Ray *rays, int count) {
+  constexpr int P = RayPacket::SIZE;
+  for (int k = 0; k < P; k++) {
+    const Ray &ray = rays[k < count ? k : 0];
+    for (int a = 0; a < 3; a++) {
+      soa.o[a][k] = ray.o[a];
+      soa.inv_dir[a][k] = 1.0f / ray.d[a];
+    }
+    soa.t_min[k] = k < count ? ray.t_min : 1.0f;
+    soa.t_max[k] = k < count ? ray.t_max : 0.0f;
+  }
+  for (int a = 0; a < 3; a++) {
+    dir_is_neg[a] = soa.inv_dir[a][0] < 0.0f;
+    for (int k = 1; k < count; k++) {
+      coherent &= (soa.inv_dir[a][k] < 0.0f) == (dir_is_neg[a] != 0);
+    }
+  }
+  for (int a = 0; a < 3; a++) {
+    float o_lo = soa.o[a][0], o_hi = soa.o[a][0];
+    inv_lo[a] = inv_hi[a] = soa.inv_dir[a][0];
+    for (int k = 1; k < count; k++) {
+      o_lo = std::min(o_lo, soa.o[a][k]);
+      o_hi = std::max(o_hi, soa.o[a][k]);
+      inv_lo[a] = std::min(inv_lo[a], soa.inv_dir[a][k]);
+      inv_hi[a] = std::max(inv_hi[a], soa.inv_dir[a][k]);
+    }
+    o_near[a] = dir_is_neg[a] ? o_lo : o_hi;
+    o_far[a] = dir_is_neg[a] ? o_hi : o_lo;
+    use_interval &= std::isfinite(inv_lo[a]) && std::isfinite(inv_hi[a]);
+  }
+  t_min = soa.t_min[0];
+  for (int k = 1; k < count; k++) {
+    t_min = std::min(t_min, soa.t_min[k]);
+  }
+}
+
+template <int N>
+unsigned PacketTraversal::candidates(const WideBVHNode<N> &node,
+                                     float near[3][N],
+                                     float far[3][N]) const {
+  for (int a = 0; a < 3; a++) {
+    for (int i = 0; i < N; i++) {
+      near[a][i] = dir_is_neg[a] ? node.max[a][i] : node.min[a][i];
+      far[a][i] = dir_is_neg[a] ? node.min[a][i] : node.max[a][i];
+    }
+  }
+  unsigned mask = 0;
+  for (int i = 0; i < N; i++) {
+    float t0 = t_min;
+    float t1 = std::numeric_limits<float>::max();
+    if (use_interval) {
+      for (int a = 0; a < 3; a++) {
+        float x = near[a][i] - o_near[a];
+        float y = far[a][i] - o_far[a];
+        float n = x * (x >= 0.0f ? inv_lo[a] : inv_hi[a]);
+        float f = y * (y >= 0.0f ? inv_hi[a] : inv_lo[a]);
+        t0 = n > t0 ? n : t0;
+        t1 = f < t1 ? f : t1;
+      }
+    }
+    mask |= static_cast<unsigned>(t0 <= t1 && node.count[i] >= 0) << i;
+  }
+  return mask;
+}
+
+template <int N>
+template <typename Intersect>
+void WideBVHTree<N>::hit(const RayPacket &packet, HitRecord *records,
+                         bool *hits, Intersect &&intersect) const {
+  constexpr int P = RayPacket::SIZE;
+  Ray rays[P];
+  for (int k = 0; k < packet.count; k++) {
+    hits[k] = false;
+    rays[k] = packet.rays[k];
+    rays[k].t_max = std::min(records[k].t, rays[k].t_max);
+  }
+  if (nodes.empty() || packet.count == 0) {
+    return;
+  }
+  auto intersect_leaf = primitive_leaves(intersect);
+
+  PacketTraversal traversal(rays, packet.count);
+  if (!traversal.coherent) {
+    for (int k = 0; k < packet.count; k++) {
+      hits[k] = traverse(0, 0, rays[k], records[k], intersect_leaf);
+    }
+    return;
+  }
+  PacketRays &soa = traversal.soa;
+
+  struct Entry {
+    int child;
+    int count;
+    unsigned mask;
+    float t_near;
+  };
+  Entry stack[BVHTree::MAX_DEPTH * N];
+  int stack_size = 0;
+  stack[stack_size++] =
+      Entry{0, 0, (1u << packet.count) - 1, traversal.t_min};
+
+  while (stack_size > 0) {
+    Entry entry = stack[--stack_size];
+    if (std::popcount(entry.mask) <= PACKET_FALLBACK_RAYS) {
+      for (unsigned mask = entry.mask; mask; mask &= mask - 1) {
+        int k = std::countr_zero(mask);
+        if (traverse(entry.child, entry.count, rays[k], records[k],
+                     intersect_leaf)) {
+          soa.t_max[k] = rays[k].t_max;
+          hits[k] = true;
+        }
+      }
+      continue;
+    }
+    if (entry.count > 0) {
+      for (int i = 0; i < entry.count; i++) {
+        int primitive = primitive_indices[entry.child + i];
+        for (unsigned mask = entry.mask; mask; mask &= mask - 1) {
+          int k = std::countr_zero(mask);
+          if (intersect(primitive, rays[k], records[k])) {
+            rays[k].t_max = soa.t_max[k] = records[k].t;
+            hits[k] = true;
+          }
+        }
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    float near[3][N], far[3][N];
+    unsigned candidates = traversal.candidates(node, near, far);
+
+    // push far to near by the nearest entry of any ray
+    int first = stack_size;
+    for (; candidates; candidates &= candidates - 1) {
+      int i = std::countr_zero(candidates);
+      float child_near[3] = {near[0][i], near[1][i], near[2][i]};
+      float child_far[3] = {far[0][i], far[1][i], far[2][i]};
+      float t_near;
+      unsigned mask =
+          intersect_rays(soa, child_near, child_far, t_near) & entry.mask;
+      if (mask == 0) {
+        continue;
+      }
+      int j = stack_size++;
+      while (j > first && stack[j - 1].t_near < t_near) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = Entry{node.child[i], node.count[i], mask, t_near};
+    }
+  }
+}
+
+template <int N>
+template <typename Occluded>
+void WideBVHTree<N>::occluded(const RayPacket &packet, bool *blocked,
+                              Occluded &&occluded) const {
+  for (int k = 0; k < packet.count; k++) {
+    blocked[k] = false;
+  }
+  if (nodes.empty() || packet.count == 0) {
+    return;
+  }
+  auto occluded_leaf = primitive_occluders(occluded);
+
+  PacketTraversal traversal(packet.rays, packet.count);
+  if (!traversal.coherent) {
+    for (int k = 0; k < packet.count; k++) {
+      blocked[k] = occluded_subtree(0, 0, packet.rays[k], occluded_leaf);
+    }
+    return;
+  }
+
+  // rays still without an occluder; any hit ends a ray's search, so nodes
+  // are not sorted by distance
+  unsigned active = (1u << packet.count) - 1;
+  struct Entry {
+    int child;
+    int count;
+    unsigned mask;
+  };
+  Entry stack[BVHTree::MAX_DEPTH * N];
+  int stack_size = 0;
+  stack[stack_size++] = Entry{0, 0, active};
+
+  while (stack_size > 0 && active) {
+    Entry entry = stack[--stack_size];
+    unsigned mask = entry.mask & active;
+    if (std::popcount(mask) <= PACKET_FALLBACK_RAYS || entry.count > 0) {
+      for (; mask; mask &= mask - 1) {
+        int k = std::countr_zero(mask);
+        if (occluded_subtree(entry.child, entry.count, packet.rays[k],
+                             occluded_leaf)) {
+          blocked[k] = true;
+          active &= ~(1u << k);
+        }
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    float near[3][N], far[3][N];
+    for (unsigned candidates = traversal.candidates(node, near, far);
+         candidates; candidates &= candidates - 1) {
+      int i = std::countr_zero(candidates);
+      float child_near[3] = {near[0][i], near[1][i], near[2][i]};
+      float child_far[3] = {far[0][i], far[1][i], far[2][i]};
+      float t_near;
+      unsigned child_mask =
+          intersect_rays(traversal.soa, child_near, child_far, t_near) & mask;
+      if (child_mask != 0) {
+        stack[stack_size++] = Entry{node.child[i], node.count[i], child_mask};
+      }
+    }
+  }
+}
+
+// top level wide hierarchy over the objects of a scene
+template <int N> class WideBVH : public Accel {
+public:
+  WideBVH(const std::vector<std::unique_ptr<Hittable>> &list,
+          SplitMethod split_method = SplitMethod::SAH)
+      : list(list), m_split_method(split_method) {}
+
+  virtual void
+  build(const std::vector<std::unique_ptr<Hittable>> &list) override {
+    BVHTree binary(m_split_method);
+    binary.build(primitive_info(list));
+    tree.build(binary);
+  }
+
+  virtual BBox bbox() const override { return tree.bbox(); }
+
+  virtual bool hit(const Ray &ray, HitRecord &record) const override;
+
+  virtual void hit(const RayPacket &packet, HitRecord *records,
+                   bool *hits) const override;
+
+  virtual bool occluded(const Ray &ray, float t_max) const override;
+
+  virtual void occluded(const RayPacket &packet,
+                        bool *blocked) const override;
+
+  size_t node_count() const { return tree.node_count(); }
+
+private:
+  WideBVHTree<N> tree;
+  const std::vector<std::unique_ptr<Hittable>> &list;
+  SplitMethod m_split_method;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
@@ -0,0 +1,93 @@
+// LightBVH::sample must pick lights with exactly the probabilities pmf
+// reports, which multiple importance sampling relies on.
+#include "light_bvh.h"
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+namespace {
+
+// Lights of varied size and power, some two sided, some emitting in a cone
+// and some without power.
+std::vector<LightBounds> make_lights(std::mt19937 &rng) {
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  auto point = [&](float size) {
+    return glm::vec3(u(rng) - 0.5f, u(rng) - 0.5f, u(rng) - 0.5f) * size;
+  };
+  std::vector<LightBounds> lights(200);
+  for (size_t i = 0; i < lights.size(); i++) {
+    auto &light = lights[i];
+    glm::vec3 center = point(20.0f);
+    glm::vec3 extent = glm::abs(point(2.0f));
+    light.bounds = BBox(center - extent, center + extent);
+    light.phi = i % 10 == 0 ? 0.0f : u(rng) * 10.0f;
+    light.w = glm::normalize(point(1.0f));
+    light.cos_theta_o = i % 3 == 0 ? -1.0f : u(rng);
+    light.cos_theta_e = i % 4 == 0 ? 0.0f : u(rng);
+    light.two_sided = i % 5 == 0;
+  }
+  return lights;
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  auto lights = make_lights(rng);
+  LightBVH bvh(lights);
+  const int samples = 1 << 16;
+  int failures = 0;
+  double worst = 0.0;
+  for (int q = 0; q < 100; q++) {
+    glm::vec3 p(u(rng) * 30 - 15, u(rng) * 30 - 15, u(rng) * 30 - 15);
+    // every other point ignores the surface
+    glm::vec3 n = q % 2 ? glm::normalize(glm::vec3(u(rng) - 0.5f,
+                                                   u(rng) - 0.5f,
+                                                   u(rng) - 0.5f))
+                        : glm::vec3(0.0f);
+    std::vector<double> pmfs(lights.size());
+    double total = 0.0;
+    for (size_t i = 0; i < lights.size(); i++) {
+      pmfs[i] = bvh.pmf(p, n, static_cast<int>(i));
+      total += pmfs[i];
+    }
+    // stratified u, so the frequencies converge quickly
+    std::vector<int> counts(lights.size(), 0);
+    int picked = 0;
+    for (int s = 0; s < samples; s++) {
+      float pmf;
+      int light = bvh.sample(p, n, (s + 0.5f) / samples, pmf);
+      if (light < 0) {
+        continue;
+      }
+      picked++;
+      counts[light]++;
+      // both are float products over the path to the leaf
+      if (std::abs(pmf - pmfs[light]) > 1e-4 * pmfs[light]) {
+        std::printf("point %d light %d: sample gave pmf %g, pmf %g\n", q,
+                    light, pmf, pmfs[light]);
+        failures++;
+      }
+    }
+    // The walk gives up where both children of a node are out of reach,
+    // so the pmfs sum to the chance of picking any light, at most 1.
+    if (total > 1.0 + 1e-4 ||
+        std::abs(total - double(picked) / samples) > 1e-3) {
+      std::printf("point %d: pmfs sum to %g, %g of the samples picked one\n",
+                  q, total, double(picked) / samples);
+      failures++;
+    }
+    for (size_t i = 0; i < lights.size(); i++) {
+      double error = std::abs(double(counts[i]) / samples - pmfs[i]);
+      worst = std::max(worst, error);
+      if (error > 1e-3) {
+        std::printf("point %d light %zu: sampled %g, pmf %g\n", q, i,
+                    double(counts[i]) / samples, pmfs[i]);
+        failures++;
+      }
+    }
+  }
+  std::printf("%d failures, largest frequency error %g\n", failures, worst);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+// Packet traversal must find exactly the hits and occlusions that tracing
+// the rays one by one does, including on ties between coincident objects.
+#include "hittable.h"
+#include "material.h"
+#include <cstdio>
+#include <random>
+
+namespace {
+
+// Random spheres, pairs of coincident spheres and pairs of meshes that share
+// a triangle but have different bounds, so many rays see several objects at
+// exactly the same distance and single rays and packets can reach them in
+// different orders.
+void make_scene(Scene &scene, AccelType accel_type) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  auto point = [&](float size) {
+    return glm::vec3(u(rng) - 0.5f, u(rng) - 0.5f, u(rng) - 0.5f) * size;
+  };
+  auto material = std::make_shared<Lambertian>(glm::vec3(0.5f));
+  for (int i = 0; i < 500; i++) {
+    glm::vec3 center = point(20.0f);
+    float radius = 0.2f + u(rng) * 0.8f;
+    int copies = i % 3 == 0 ? 2 : 1;
+    for (int c = 0; c < copies; c++) {
+      scene.add(std::make_unique<Sphere>(center, radius, material));
+    }
+  }
+  for (int i = 0; i < 500; i++) {
+    glm::vec3 center = point(20.0f);
+    std::vector<glm::vec3> shared = {center + point(2.0f),
+                                     center + point(2.0f),
+                                     center + point(2.0f)};
+    for (int c = 0; c < 2; c++) {
+      std::vector<glm::vec3> vertices = shared;
+      glm::vec3 offset = point(8.0f);
+      for (int k = 0; k < 3; k++) {
+        vertices.push_back(shared[k] + offset);
+      }
+      scene.add(std::make_unique<Mesh>(vertices,
+                                       std::vector<int>{0, 1, 2, 3, 4, 5},
+                                       material));
+    }
+  }
+  scene.accel_type = accel_type;
+  scene.build();
+}
+
+// Packets of rays from one origin toward neighbouring points, which share
+// node tests, and of rays in random directions, which fall back to single
+// rays. Every other packet is cut short to check partial packets.
+RayPacket make_packet(std::mt19937 &rng, int index) {
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  RayPacket packet;
+  packet.count = index % 2 ? RayPacket::SIZE : 1 + index % RayPacket::SIZE;
+  glm::vec3 origin(u(rng) * 30 - 15, u(rng) * 30 - 15, -25.0f);
+  glm::vec3 target(u(rng) * 20 - 10, u(rng) * 20 - 10, 0.0f);
+  bool coherent = index % 4 != 3;
+  for (int k = 0; k < packet.count; k++) {
+    glm::vec3 direction =
+        coherent ? target + glm::vec3(k % 4, k / 4, 0.0f) * 0.5f - origin
+                 : glm::vec3(u(rng) - 0.5f, u(rng) - 0.5f, u(rng) - 0.5f);
+    packet.rays[k] = Ray(origin, glm::normalize(direction));
+    // shadow rays end at varying distances
+    packet.rays[k].t_max = 10.0f + u(rng) * 40.0f;
+  }
+  return packet;
+}
+
+int compare(AccelType accel_type, const char *name) {
+  Scene scene;
+  make_scene(scene, accel_type);
+  std::mt19937 rng(2);
+  int mismatches = 0;
+  for (int p = 0; p < 20000; p++) {
+    RayPacket packet = make_packet(rng, p);
+    HitRecord records[RayPacket::SIZE];
+    bool hits[RayPacket::SIZE];
+    scene.hit(packet, records, hits);
+    bool blocked[RayPacket::SIZE];
+    scene.occluded(packet, blocked);
+    for (int k = 0; k < packet.count; k++) {
+      const Ray &ray = packet.rays[k];
+      HitRecord record;
+      bool hit = scene.hit(ray, record);
+      if (hit != hits[k] ||
+          (hit && (record.t != records[k].t ||
+                   record.object_id != records[k].object_id ||
+                   record.primitive_id != records[k].primitive_id))) {
+        mismatches++;
+      }
+      if (scene.occluded(ray, ray.t_max) != blocked[k]) {
+        mismatches++;
+      }
+    }
+  }
+  std::printf("%s: %d mismatches\n", name, mismatches);
+  return mismatches;
+}
+
+} // namespace
+
+int main() {
+  int mismatches = compare(AccelType::BVH, "BVH") +
+                   compare(AccelType::BVH4, "BVH4") +
+                   compare(AccelType::BVH8, "BVH8");
+  return mismatches == 0 ? 0 : 1;
+}
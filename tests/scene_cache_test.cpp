@@ -0,0 +1,171 @@
+// A scene saved to the cache and loaded back must trace exactly like the
+// original, and damaged or stale caches must be rejected.
+#include "scene_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+
+namespace {
+
+const char *CACHE_PATH = "scene_cache_test.cache";
+const char *SOURCE_PATH = "scene_cache_test.obj";
+
+// A grid of wavy quads cut into meshes that share one vertex buffer, and a
+// separate mesh, with every material the cache stores.
+std::unique_ptr<Scene> make_scene() {
+  const int size = 40;
+  auto vertices = std::make_shared<std::vector<glm::vec3>>();
+  for (int j = 0; j <= size; j++) {
+    for (int i = 0; i <= size; i++) {
+      vertices->push_back(glm::vec3(i - size / 2, std::sin(i * 0.7f + j),
+                                    j - size / 2));
+    }
+  }
+  std::vector<std::shared_ptr<Material>> materials = {
+      std::make_shared<Lambertian>(glm::vec3(0.2f, 0.4f, 0.6f)),
+      std::make_shared<Metal>(glm::vec3(0.9f, 0.8f, 0.7f), 0.3f),
+      std::make_shared<Dielectric>(1.5f),
+      std::make_shared<DiffuseLight>(glm::vec3(4.0f))};
+  auto scene = std::make_unique<Scene>();
+  for (int part = 0; part < 4; part++) {
+    std::vector<int> indices;
+    for (int j = part * size / 4; j < (part + 1) * size / 4; j++) {
+      for (int i = 0; i < size; i++) {
+        int v = j * (size + 1) + i;
+        indices.insert(indices.end(), {v, v + 1, v + size + 2, v,
+                                       v + size + 2, v + size + 1});
+      }
+    }
+    scene->add(std::make_unique<Mesh>(vertices, indices, materials[part]));
+  }
+  scene->add(std::make_unique<Mesh>(
+      std::vector<glm::vec3>{{-5, 5, -5}, {5, 5, -5}, {0, 5, 5}},
+      std::vector<int>{0, 1, 2}, materials[3]));
+  return scene;
+}
+
+std::vector<char> read_file(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(file), {});
+}
+
+void write_file(const char *path, const std::vector<char> &data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(data.data(), data.size());
+}
+
+std::vector<Ray> make_rays(int count) {
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+  std::vector<Ray> rays;
+  for (int i = 0; i < count; i++) {
+    glm::vec3 origin(u(rng) * 20.0f, 10.0f + u(rng) * 5.0f, u(rng) * 20.0f);
+    glm::vec3 direction(u(rng), -1.0f, u(rng));
+    rays.push_back(Ray(origin, glm::normalize(direction)));
+  }
+  return rays;
+}
+
+} // namespace
+
+int main() {
+  int failures = 0;
+  write_file(SOURCE_PATH, {'o', ' ', 'g', 'r', 'i', 'd', '\n'});
+  auto scene = make_scene();
+  if (!save_scene_cache(CACHE_PATH, *scene, {SOURCE_PATH})) {
+    std::printf("cannot save the cache\n");
+    return 1;
+  }
+  scene->build();
+
+  auto loaded = load_scene_cache(CACHE_PATH);
+  if (!loaded) {
+    std::printf("cannot load the cache\n");
+    return 1;
+  }
+  loaded->build();
+  int mismatches = 0;
+  for (const Ray &ray : make_rays(20000)) {
+    HitRecord a;
+    HitRecord b;
+    bool hit_a = scene->hit(ray, a);
+    bool hit_b = loaded->hit(ray, b);
+    if (hit_a != hit_b ||
+        (hit_a && (a.t != b.t || a.object_id != b.object_id ||
+                   a.primitive_id != b.primitive_id || a.p != b.p ||
+                   a.normal != b.normal ||
+                   scene->material_type(a.material_id) !=
+                       loaded->material_type(b.material_id)))) {
+      mismatches++;
+    }
+  }
+  std::printf("loaded scene: %d mismatches\n", mismatches);
+  failures += mismatches;
+
+  std::vector<char> original = read_file(CACHE_PATH);
+  auto rejected = [&](const std::vector<char> &data) {
+    write_file(CACHE_PATH, data);
+    return load_scene_cache(CACHE_PATH) == nullptr;
+  };
+
+  // an index past the end of the vertex buffer
+  auto indices = static_cast<const Mesh &>(*scene->get(0)).indices();
+  std::vector<char> bad = original;
+  auto first = std::search(bad.begin(), bad.end(),
+                           reinterpret_cast<const char *>(indices.data()),
+                           reinterpret_cast<const char *>(indices.data() +
+                                                          indices.size()));
+  int out_of_range = 1 << 20;
+  if (first != bad.end()) {
+    std::memcpy(&*first, &out_of_range, sizeof(out_of_range));
+  }
+  if (first == bad.end() || !rejected(bad)) {
+    std::printf("a bad vertex index was not rejected\n");
+    failures++;
+  }
+
+  // truncated
+  if (!rejected(std::vector<char>(original.begin(),
+                                  original.begin() + original.size() / 2))) {
+    std::printf("a truncated cache was not rejected\n");
+    failures++;
+  }
+
+  // Random words overwritten: what loads must still trace without reading
+  // outside the cache, which sanitizer builds check.
+  std::mt19937 rng(3);
+  const int values[] = {-2, -1, 1, 1 << 20, 0x7fffffff};
+  int accepted = 0;
+  for (int i = 0; i < 300; i++) {
+    std::vector<char> damaged = original;
+    size_t word = rng() % (damaged.size() / 4);
+    int value = values[rng() % std::size(values)];
+    std::memcpy(&damaged[word * 4], &value, sizeof(value));
+    write_file(CACHE_PATH, damaged);
+    if (auto damaged_scene = load_scene_cache(CACHE_PATH)) {
+      accepted++;
+      damaged_scene->build();
+      for (const Ray &ray : make_rays(200)) {
+        HitRecord record;
+        damaged_scene->hit(ray, record);
+        damaged_scene->occluded(ray, 100.0f);
+      }
+    }
+  }
+  std::printf("%d of 300 damaged caches loaded\n", accepted);
+
+  // stale once the source changes
+  write_file(CACHE_PATH, original);
+  write_file(SOURCE_PATH, {'o', ' ', 'q', 'u', 'a', 'd', 's', '\n'});
+  if (load_scene_cache(CACHE_PATH)) {
+    std::printf("a stale cache was not rejected\n");
+    failures++;
+  }
+
+  std::remove(CACHE_PATH);
+  std::remove(SOURCE_PATH);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+// The triangle test is watertight: rays aimed at the edge two triangles
+// share must hit one of them, whichever way the compiler schedules the math.
+#include "hittable.h"
+#include "material.h"
+#include <cstdio>
+#include <random>
+
+int main() {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  auto point = [&](float size) {
+    return glm::vec3(u(rng) - 0.5f, u(rng) - 0.5f, u(rng) - 0.5f) * size;
+  };
+  auto material = std::make_shared<Lambertian>(glm::vec3(0.5f));
+  int misses = 0;
+  int blocked_misses = 0;
+  int rays = 0;
+  for (int q = 0; q < 1000; q++) {
+    // a convex planar quad split along its diagonal v0 v2
+    glm::vec3 center = point(20.0f);
+    glm::vec3 e1 = glm::normalize(point(1.0f));
+    glm::vec3 e2 = glm::normalize(glm::cross(e1, point(1.0f)));
+    float size = 0.1f + u(rng) * 4.0f;
+    glm::vec3 v0 = center - e1 * size;
+    glm::vec3 v2 = center + e1 * size;
+    glm::vec3 v1 = center + (e1 * (u(rng) - 0.5f) - e2) * size;
+    glm::vec3 v3 = center + (e1 * (u(rng) - 0.5f) + e2) * size;
+    Mesh quad(std::vector<glm::vec3>{v0, v1, v2, v3},
+              std::vector<int>{0, 1, 2, 0, 2, 3}, material);
+    for (int k = 0; k < 200; k++) {
+      glm::vec3 target = v0 + (v2 - v0) * (0.05f + 0.9f * u(rng));
+      glm::vec3 origin = target + glm::normalize(point(1.0f)) * 10.0f;
+      Ray ray(origin, glm::normalize(target - origin));
+      HitRecord record;
+      if (!quad.hit(ray, record)) {
+        misses++;
+      }
+      if (!quad.occluded(ray, 20.0f)) {
+        blocked_misses++;
+      }
+      rays++;
+    }
+  }
+  std::printf("%d of %d rays through shared edges missed, %d not occluded\n",
+              misses, rays, blocked_misses);
+  return misses == 0 && blocked_misses == 0 ? 0 : 1;
+}